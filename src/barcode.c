@@ -0,0 +1,759 @@
+/* barcode.c: drawing barcodes at the resolution of the print head
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "barcode.h"
+
+/**
+ * Code 128 symbols: widths of bar, space, bar, space, bar, space (and a final
+ * bar for the stop symbol) in modules. 103 to 105 are the start symbols for
+ * code set A, B and C, 106 is the stop symbol.
+ */
+static const char code128[107][8] = {
+	"212222", "222122", "222221", "121223", "121322", "131222", "122213",
+	"122312", "132212", "221213", "221312", "231212", "112232", "122132",
+	"122231", "113222", "123122", "123221", "223211", "221132", "221231",
+	"213212", "223112", "312131", "311222", "321122", "321221", "312212",
+	"322112", "322211", "212123", "212321", "232121", "111323", "131123",
+	"131321", "112313", "132113", "132311", "211313", "231113", "231311",
+	"112133", "112331", "132131", "113123", "113321", "133121", "313121",
+	"211331", "231131", "213113", "213311", "213131", "311123", "311321",
+	"331121", "312113", "312311", "332111", "314111", "221411", "431111",
+	"111224", "111422", "121124", "121421", "141122", "141221", "112214",
+	"112412", "122114", "122411", "142112", "142211", "241211", "221114",
+	"413111", "241112", "134111", "111242", "121142", "121241", "114212",
+	"124112", "124211", "411212", "421112", "421211", "212141", "214121",
+	"412121", "111143", "111341", "131141", "114113", "114311", "411113",
+	"411311", "113141", "114131", "311141", "411131", "211412", "211214",
+	"211232", "2331112"
+};
+
+#define CODE128_START_B 104
+#define CODE128_START_C 105
+#define CODE128_STOP 106
+
+/**
+ * EAN-13 digits in the left half with odd parity (set A). Set C, used on the
+ * right, is the complement, set B is set C reversed.
+ */
+static const char ean_a[10][8] = {
+	"0001101", "0011001", "0010011", "0111101", "0100011",
+	"0110001", "0101111", "0111011", "0110111", "0001011"
+};
+
+/**
+ * Which of the digits in the left half use set B, given by the first digit.
+ */
+static const char ean_parity[10][7] = {
+	"AAAAAA", "AABABB", "AABBAB", "AABBBA", "ABAABB",
+	"ABBAAB", "ABBBAA", "ABABAB", "ABABBA", "ABBABA"
+};
+
+/**
+ * Draw a line of modules into a bitmap.
+ *
+ * Runs of dark modules are filled at once, see ql_fill().
+ *
+ * @param bitmap the bitmap
+ * @param line first line to draw
+ * @param lines number of lines to draw, the first is copied
+ * @param modules one byte per module, non-zero is dark
+ * @param count number of modules
+ * @param module width of a module in dots
+ */
+static void
+draw_modules(ql_bitmap *bitmap, uint32_t line, uint32_t lines,
+		const uint8_t *modules, size_t count, unsigned int module)
+{
+	uint8_t *dst = bitmap->data + line * bitmap->stride;
+
+	for (size_t i = 0; i < count; ) {
+		size_t run = 1;
+
+		while (i + run < count && (modules[i + run] != 0) == (modules[i] != 0))
+			run++;
+
+		if (modules[i])
+			ql_fill(dst, i * module, run * module);
+
+		i += run;
+	}
+
+	for (uint32_t i = 1; i < lines; i++)
+		memcpy(dst + i * bitmap->stride, dst, bitmap->stride);
+}
+
+/**
+ * Draw a one-dimensional barcode.
+ *
+ * @param modules one byte per module, non-zero is dark
+ * @param count number of modules
+ * @param module width of a module in dots
+ * @param height height of the bars in lines
+ * @param bitmap bitmap to initialise, release with ql_bitmap_free()
+ * @returns false if out of memory
+ */
+static bool
+render_bars(const uint8_t *modules, size_t count, unsigned int module,
+		uint32_t height, ql_bitmap *bitmap)
+{
+	if (!ql_bitmap_init(bitmap, count * module, height))
+		return false;
+
+	if (height > 0)
+		draw_modules(bitmap, 0, height, modules, count, module);
+
+	return true;
+}
+
+/**
+ * Draw a Code 128 barcode.
+ *
+ * Data consisting of an even number of digits is encoded with code set C (two
+ * digits per symbol), anything else with code set B. There is no quiet zone
+ * around the bars.
+ *
+ * @param data printable ASCII characters
+ * @param module width of the narrowest bar in dots
+ * @param height height of the bars in lines
+ * @param bitmap bitmap to initialise, release with ql_bitmap_free()
+ * @returns false if the data cannot be encoded or out of memory
+ */
+bool
+ql_code128_render(const char *data, unsigned int module, uint32_t height,
+		ql_bitmap *bitmap)
+{
+	size_t length = strlen(data);
+	bool digits = length > 0 && length % 2 == 0
+		&& strspn(data, "0123456789") == length;
+	size_t count = digits ? length / 2 : length;
+
+	// Start, data, checksum and stop symbols.
+	unsigned int *symbols = malloc((count + 3) * sizeof(unsigned int));
+	uint8_t *modules = malloc((count + 3) * 11 + 2);
+	size_t width = 0;
+	bool ok = symbols != NULL && modules != NULL && length > 0;
+
+	if (ok) {
+		symbols[0] = digits ? CODE128_START_C : CODE128_START_B;
+
+		unsigned int checksum = symbols[0];
+
+		for (size_t i = 0; i < count; i++) {
+			if (digits) {
+				symbols[i + 1] = (data[2 * i] - '0') * 10 + data[2 * i + 1] - '0';
+			} else {
+				uint8_t c = data[i];
+				ok = ok && c >= 32 && c < 128;
+				symbols[i + 1] = c - 32;
+			}
+
+			checksum += symbols[i + 1] * (i + 1);
+		}
+
+		symbols[count + 1] = checksum % 103;
+		symbols[count + 2] = CODE128_STOP;
+	}
+
+	for (size_t i = 0; ok && i < count + 3; i++) {
+		const char *widths = code128[symbols[i]];
+
+		for (size_t j = 0; widths[j] != '\0'; j++) {
+			for (int k = 0; k < widths[j] - '0'; k++)
+				modules[width++] = j % 2 == 0;
+		}
+	}
+
+	ok = ok && render_bars(modules, width, module, height, bitmap);
+
+	free(symbols);
+	free(modules);
+
+	return ok;
+}
+
+/**
+ * Draw an EAN-13 barcode.
+ *
+ * @param data 12 digits, or 13 digits including the check digit
+ * @param module width of the narrowest bar in dots
+ * @param height height of the bars in lines
+ * @param bitmap bitmap to initialise, release with ql_bitmap_free()
+ * @returns false if the data is not a valid EAN-13 or out of memory
+ */
+bool
+ql_ean13_render(const char *data, unsigned int module, uint32_t height,
+		ql_bitmap *bitmap)
+{
+	size_t length = strlen(data);
+	uint8_t modules[95];
+	unsigned int digit[13];
+	unsigned int sum = 0;
+	size_t width = 0;
+
+	if ((length != 12 && length != 13) || strspn(data, "0123456789") != length)
+		return false;
+
+	for (size_t i = 0; i < 12; i++) {
+		digit[i] = data[i] - '0';
+		sum += digit[i] * (i % 2 == 0 ? 1 : 3);
+	}
+
+	digit[12] = (10 - sum % 10) % 10;
+
+	if (length == 13 && (unsigned int)(data[12] - '0') != digit[12])
+		return false;
+
+	const char *parity = ean_parity[digit[0]];
+
+	memcpy(modules, "\1\0\1", 3);
+	width += 3;
+
+	for (size_t i = 1; i <= 6; i++) {
+		for (size_t j = 0; j < 7; j++) {
+			if (parity[i - 1] == 'A')
+				modules[width++] = ean_a[digit[i]][j] == '1';
+			else
+				modules[width++] = ean_a[digit[i]][6 - j] == '0';
+		}
+	}
+
+	memcpy(modules + width, "\0\1\0\1\0", 5);
+	width += 5;
+
+	for (size_t i = 7; i <= 12; i++) {
+		for (size_t j = 0; j < 7; j++)
+			modules[width++] = ean_a[digit[i]][j] == '0';
+	}
+
+	memcpy(modules + width, "\1\0\1", 3);
+	width += 3;
+
+	return render_bars(modules, width, module, height, bitmap);
+}
+
+/**
+ * Error correction codewords per block and number of blocks for QR codes
+ * with error correction level M, by version.
+ */
+static const uint8_t qr_ecc_per_block[QL_QR_MAX_VERSION + 1] = {
+	0, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26
+};
+
+static const uint8_t qr_blocks[QL_QR_MAX_VERSION + 1] = {
+	0, 1, 1, 1, 2, 2, 4, 4, 4, 5, 5
+};
+
+typedef struct qr_code qr_code;
+struct qr_code {
+	unsigned int version;
+	unsigned int size;
+
+	/**
+	 * One byte per module, row by row, non-zero is dark.
+	 */
+	uint8_t modules[(17 + 4 * QL_QR_MAX_VERSION) * (17 + 4 * QL_QR_MAX_VERSION)];
+
+	/**
+	 * Whether a module belongs to a function pattern.
+	 */
+	uint8_t function[(17 + 4 * QL_QR_MAX_VERSION) * (17 + 4 * QL_QR_MAX_VERSION)];
+};
+
+static void
+qr_set_function(qr_code *qr, unsigned int x, unsigned int y, bool dark)
+{
+	qr->modules[y * qr->size + x] = dark;
+	qr->function[y * qr->size + x] = 1;
+}
+
+/**
+ * Number of modules that hold data or error correction.
+ */
+static unsigned int
+qr_raw_modules(unsigned int version)
+{
+	unsigned int result = (16 * version + 128) * version + 64;
+
+	if (version >= 2) {
+		unsigned int align = version / 7 + 2;
+		result -= (25 * align - 10) * align - 55;
+
+		if (version >= 7)
+			result -= 36;
+	}
+
+	return result;
+}
+
+/**
+ * Number of data codewords (excluding error correction).
+ */
+static unsigned int
+qr_data_codewords(unsigned int version)
+{
+	return qr_raw_modules(version) / 8
+		- qr_ecc_per_block[version] * qr_blocks[version];
+}
+
+/**
+ * Append bits to the data codewords, most significant bit first.
+ */
+static void
+put_bits(uint8_t *codewords, size_t *bit, unsigned int value, int count)
+{
+	for (int i = count - 1; i >= 0; i--, (*bit)++)
+		codewords[*bit / 8] |= ((value >> i) & 1) << (7 - *bit % 8);
+}
+
+/**
+ * Multiply in GF(2^8) with the QR code polynomial 0x11D.
+ */
+static uint8_t
+gf_multiply(uint8_t x, uint8_t y)
+{
+	unsigned int z = 0;
+
+	for (int i = 7; i >= 0; i--) {
+		z = (z << 1) ^ ((z >> 7) * 0x11D);
+		z ^= ((y >> i) & 1) * x;
+	}
+
+	return z;
+}
+
+/**
+ * Reed-Solomon error correction codewords for a block.
+ *
+ * @param data data codewords
+ * @param length number of data codewords
+ * @param ecc error correction codewords to fill
+ * @param degree number of error correction codewords, at most 30
+ */
+static void
+qr_reed_solomon(const uint8_t *data, size_t length, uint8_t *ecc, unsigned int degree)
+{
+	uint8_t divisor[30] = { 0 };
+	uint8_t root = 1;
+
+	divisor[degree - 1] = 1;
+
+	for (unsigned int i = 0; i < degree; i++) {
+		for (unsigned int j = 0; j < degree; j++) {
+			divisor[j] = gf_multiply(divisor[j], root);
+
+			if (j + 1 < degree)
+				divisor[j] ^= divisor[j + 1];
+		}
+
+		root = gf_multiply(root, 0x02);
+	}
+
+	memset(ecc, 0x00, degree);
+
+	for (size_t i = 0; i < length; i++) {
+		uint8_t factor = data[i] ^ ecc[0];
+
+		memmove(ecc, ecc + 1, degree - 1);
+		ecc[degree - 1] = 0;
+
+		for (unsigned int j = 0; j < degree; j++)
+			ecc[j] ^= gf_multiply(divisor[j], factor);
+	}
+}
+
+/**
+ * Draw finder, timing and alignment patterns and reserve the format and
+ * version areas.
+ */
+static void
+qr_draw_functions(qr_code *qr)
+{
+	unsigned int size = qr->size;
+
+	for (unsigned int i = 0; i < size; i++) {
+		qr_set_function(qr, 6, i, i % 2 == 0);
+		qr_set_function(qr, i, 6, i % 2 == 0);
+	}
+
+	// Finder patterns with their separators.
+	const unsigned int finders[3][2] = { {3, 3}, {size - 4, 3}, {3, size - 4} };
+
+	for (int f = 0; f < 3; f++) {
+		for (int dy = -4; dy <= 4; dy++) {
+			for (int dx = -4; dx <= 4; dx++) {
+				int x = finders[f][0] + dx;
+				int y = finders[f][1] + dy;
+				int distance = abs(dx) > abs(dy) ? abs(dx) : abs(dy);
+
+				if (x >= 0 && x < (int)size && y >= 0 && y < (int)size)
+					qr_set_function(qr, x, y, distance != 2 && distance != 4);
+			}
+		}
+	}
+
+	// Alignment patterns, except where they would overlap the finders.
+	if (qr->version >= 2) {
+		unsigned int count = qr->version / 7 + 2;
+		unsigned int step = (qr->version * 4 + count * 2 + 1) / (count * 2 - 2) * 2;
+		unsigned int positions[7];
+
+		positions[0] = 6;
+
+		for (unsigned int i = count - 1; i >= 1; i--)
+			positions[i] = size - 7 - (count - 1 - i) * step;
+
+		for (unsigned int i = 0; i < count; i++) {
+			for (unsigned int j = 0; j < count; j++) {
+				if ((i == 0 && j == 0) || (i == 0 && j == count - 1)
+				    || (i == count - 1 && j == 0))
+					continue;
+
+				for (int dy = -2; dy <= 2; dy++) {
+					for (int dx = -2; dx <= 2; dx++)
+						qr_set_function(qr, positions[i] + dx, positions[j] + dy,
+								abs(dx) == 2 || abs(dy) == 2
+								|| (dx == 0 && dy == 0));
+				}
+			}
+		}
+	}
+
+	// Version information.
+	if (qr->version >= 7) {
+		unsigned int remainder = qr->version;
+
+		for (int i = 0; i < 12; i++)
+			remainder = (remainder << 1) ^ ((remainder >> 11) * 0x1F25);
+
+		uint32_t bits = qr->version << 12 | remainder;
+
+		for (int i = 0; i < 18; i++) {
+			bool dark = (bits >> i) & 1;
+			unsigned int a = size - 11 + i % 3;
+			unsigned int b = i / 3;
+
+			qr_set_function(qr, a, b, dark);
+			qr_set_function(qr, b, a, dark);
+		}
+	}
+
+	// The format areas are filled in after choosing a mask, see
+	// qr_draw_format().
+	for (unsigned int i = 0; i < 9; i++) {
+		qr_set_function(qr, 8, i, false);
+		qr_set_function(qr, i, 8, false);
+	}
+
+	for (unsigned int i = 0; i < 8; i++) {
+		qr_set_function(qr, size - 1 - i, 8, false);
+		qr_set_function(qr, 8, size - 1 - i, false);
+	}
+}
+
+/**
+ * Draw the format information (error correction level M and the mask).
+ */
+static void
+qr_draw_format(qr_code *qr, unsigned int mask)
+{
+	unsigned int size = qr->size;
+	unsigned int data = mask;  // Level M is 00.
+	unsigned int remainder = data;
+
+	for (int i = 0; i < 10; i++)
+		remainder = (remainder << 1) ^ ((remainder >> 9) * 0x537);
+
+	unsigned int bits = (data << 10 | remainder) ^ 0x5412;
+
+	for (int i = 0; i <= 5; i++)
+		qr_set_function(qr, 8, i, (bits >> i) & 1);
+
+	qr_set_function(qr, 8, 7, (bits >> 6) & 1);
+	qr_set_function(qr, 8, 8, (bits >> 7) & 1);
+	qr_set_function(qr, 7, 8, (bits >> 8) & 1);
+
+	for (int i = 9; i < 15; i++)
+		qr_set_function(qr, 14 - i, 8, (bits >> i) & 1);
+
+	for (int i = 0; i < 8; i++)
+		qr_set_function(qr, size - 1 - i, 8, (bits >> i) & 1);
+
+	for (int i = 8; i < 15; i++)
+		qr_set_function(qr, 8, size - 15 + i, (bits >> i) & 1);
+
+	qr_set_function(qr, 8, size - 8, true);
+}
+
+/**
+ * Place the codewords in the zig-zag order of the symbol.
+ */
+static void
+qr_draw_codewords(qr_code *qr, const uint8_t *codewords, size_t length)
+{
+	unsigned int size = qr->size;
+	size_t i = 0;
+
+	for (int right = size - 1; right >= 1; right -= 2) {
+		if (right == 6)
+			right = 5;
+
+		for (unsigned int vertical = 0; vertical < size; vertical++) {
+			for (int j = 0; j < 2; j++) {
+				unsigned int x = right - j;
+				bool upward = ((right + 1) & 2) == 0;
+				unsigned int y = upward ? size - 1 - vertical : vertical;
+
+				if (qr->function[y * size + x] || i >= length * 8)
+					continue;
+
+				qr->modules[y * size + x] = (codewords[i / 8] >> (7 - i % 8)) & 1;
+				i++;
+			}
+		}
+	}
+}
+
+/**
+ * Flip the data modules with one of the eight masks. Applying a mask twice
+ * undoes it.
+ */
+static void
+qr_apply_mask(qr_code *qr, unsigned int mask)
+{
+	for (unsigned int y = 0; y < qr->size; y++) {
+		for (unsigned int x = 0; x < qr->size; x++) {
+			bool flip;
+
+			switch (mask) {
+			case 0: flip = (x + y) % 2 == 0; break;
+			case 1: flip = y % 2 == 0; break;
+			case 2: flip = x % 3 == 0; break;
+			case 3: flip = (x + y) % 3 == 0; break;
+			case 4: flip = (x / 3 + y / 2) % 2 == 0; break;
+			case 5: flip = x * y % 2 + x * y % 3 == 0; break;
+			case 6: flip = (x * y % 2 + x * y % 3) % 2 == 0; break;
+			default: flip = ((x + y) % 2 + x * y % 3) % 2 == 0; break;
+			}
+
+			if (flip && !qr->function[y * qr->size + x])
+				qr->modules[y * qr->size + x] ^= 1;
+		}
+	}
+}
+
+/**
+ * Penalty of a line of modules: long runs of one colour and patterns that
+ * look like a finder.
+ */
+static unsigned int
+qr_line_penalty(const qr_code *qr, unsigned int index, bool column)
+{
+	static const uint8_t finder[2][11] = {
+		{ 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 0 },
+		{ 0, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1 }
+	};
+	unsigned int size = qr->size;
+	unsigned int penalty = 0;
+	uint8_t line[17 + 4 * QL_QR_MAX_VERSION];
+
+	for (unsigned int i = 0; i < size; i++)
+		line[i] = column ? qr->modules[i * size + index] : qr->modules[index * size + i];
+
+	for (unsigned int i = 0; i < size; ) {
+		unsigned int run = 1;
+
+		while (i + run < size && line[i + run] == line[i])
+			run++;
+
+		if (run >= 5)
+			penalty += run - 2;
+
+		i += run;
+	}
+
+	for (unsigned int i = 0; i + 11 <= size; i++) {
+		for (int f = 0; f < 2; f++) {
+			if (memcmp(line + i, finder[f], 11) == 0)
+				penalty += 40;
+		}
+	}
+
+	return penalty;
+}
+
+/**
+ * Penalty of a masked symbol, lower is easier to read.
+ */
+static unsigned int
+qr_penalty(const qr_code *qr)
+{
+	unsigned int size = qr->size;
+	unsigned int penalty = 0;
+	unsigned int dark = 0;
+
+	for (unsigned int i = 0; i < size; i++)
+		penalty += qr_line_penalty(qr, i, false) + qr_line_penalty(qr, i, true);
+
+	for (unsigned int y = 0; y < size; y++) {
+		for (unsigned int x = 0; x < size; x++) {
+			const uint8_t *m = qr->modules + y * size + x;
+
+			dark += *m;
+
+			if (x + 1 < size && y + 1 < size
+			    && m[0] == m[1] && m[0] == m[size] && m[0] == m[size + 1])
+				penalty += 3;
+		}
+	}
+
+	unsigned int total = size * size;
+	unsigned int k = (abs((int)(dark * 20) - (int)(total * 10)) + total - 1) / total - 1;
+
+	return penalty + k * 10;
+}
+
+/**
+ * Draw a QR code.
+ *
+ * The data is encoded as bytes with error correction level M, in the smallest
+ * version up to QL_QR_MAX_VERSION that holds it. There is no quiet zone
+ * around the symbol.
+ *
+ * @param data the data
+ * @param module width of a module in dots
+ * @param module_lines height of a module in lines
+ * @param bitmap bitmap to initialise, release with ql_bitmap_free()
+ * @returns false if the data does not fit or out of memory
+ */
+bool
+ql_qr_render(const char *data, unsigned int module, unsigned int module_lines,
+		ql_bitmap *bitmap)
+{
+	size_t length = strlen(data);
+	unsigned int version = 1;
+
+	// Mode indicator, character count, data.
+	while (version <= QL_QR_MAX_VERSION
+	       && 4 + (version < 10 ? 8 : 16) + length * 8 > qr_data_codewords(version) * 8)
+		version++;
+
+	if (version > QL_QR_MAX_VERSION)
+		return false;
+
+	qr_code *qr = calloc(1, sizeof(qr_code));
+	uint8_t *codewords = calloc(qr_raw_modules(QL_QR_MAX_VERSION) / 8, 1);
+	uint8_t *interleaved = calloc(qr_raw_modules(QL_QR_MAX_VERSION) / 8, 1);
+
+	if (qr == NULL || codewords == NULL || interleaved == NULL
+	    || !ql_bitmap_init(bitmap, (17 + 4 * version) * module,
+			    (17 + 4 * version) * module_lines)) {
+		free(qr);
+		free(codewords);
+		free(interleaved);
+		return false;
+	}
+
+	unsigned int capacity = qr_data_codewords(version);
+	size_t bit = 0;
+
+	// Byte mode, then the data.
+	put_bits(codewords, &bit, 0x4, 4);
+	put_bits(codewords, &bit, length, version < 10 ? 8 : 16);
+
+	for (size_t i = 0; i < length; i++)
+		put_bits(codewords, &bit, (uint8_t)data[i], 8);
+
+	// Terminator (the codewords are zeroed) and padding.
+	bit += capacity * 8 - bit < 4 ? capacity * 8 - bit : 4;
+
+	for (size_t i = (bit + 7) / 8, pad = 0; i < capacity; i++, pad++)
+		codewords[i] = pad % 2 == 0 ? 0xEC : 0x11;
+
+	// Split into blocks, add error correction and interleave.
+	unsigned int blocks = qr_blocks[version];
+	unsigned int ecc_length = qr_ecc_per_block[version];
+	unsigned int raw = qr_raw_modules(version) / 8;
+	unsigned int short_blocks = blocks - raw % blocks;
+	unsigned int short_length = raw / blocks - ecc_length;
+	uint8_t ecc[30];
+	size_t offset = 0;
+
+	for (unsigned int b = 0; b < blocks; b++) {
+		unsigned int block_length = short_length + (b < short_blocks ? 0 : 1);
+
+		qr_reed_solomon(codewords + offset, block_length, ecc, ecc_length);
+
+		for (unsigned int i = 0; i < block_length; i++) {
+			unsigned int position = i * blocks + b;
+
+			// The extra codeword of the long blocks comes after
+			// all others.
+			if (i == short_length)
+				position = short_length * blocks + (b - short_blocks);
+
+			interleaved[position] = codewords[offset + i];
+		}
+
+		for (unsigned int i = 0; i < ecc_length; i++)
+			interleaved[capacity + i * blocks + b] = ecc[i];
+
+		offset += block_length;
+	}
+
+	qr->version = version;
+	qr->size = 17 + 4 * version;
+	qr_draw_functions(qr);
+	qr_draw_codewords(qr, interleaved, raw);
+
+	// Use the mask that gives the lowest penalty.
+	unsigned int best = 0;
+	unsigned int best_penalty = UINT32_MAX;
+
+	for (unsigned int mask = 0; mask < 8; mask++) {
+		qr_apply_mask(qr, mask);
+		qr_draw_format(qr, mask);
+
+		unsigned int penalty = qr_penalty(qr);
+
+		if (penalty < best_penalty) {
+			best = mask;
+			best_penalty = penalty;
+		}
+
+		qr_apply_mask(qr, mask);
+	}
+
+	qr_apply_mask(qr, best);
+	qr_draw_format(qr, best);
+
+	for (unsigned int y = 0; y < qr->size; y++)
+		draw_modules(bitmap, y * module_lines, module_lines,
+				qr->modules + y * qr->size, qr->size, module);
+
+	free(qr);
+	free(codewords);
+	free(interleaved);
+
+	return true;
+}
@@ -0,0 +1,43 @@
+/* barcode.h: drawing barcodes at the resolution of the print head
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _BARCODE_H_
+#define _BARCODE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "transform.h"
+
+/**
+ * Largest QR code version drawn by ql_qr_render(), 57x57 modules. With
+ * error correction level M this holds 213 bytes.
+ */
+#define QL_QR_MAX_VERSION 10
+
+bool ql_code128_render(const char *data, unsigned int module, uint32_t height,
+		ql_bitmap *bitmap);
+bool ql_ean13_render(const char *data, unsigned int module, uint32_t height,
+		ql_bitmap *bitmap);
+bool ql_qr_render(const char *data, unsigned int module, unsigned int module_lines,
+		ql_bitmap *bitmap);
+
+#endif
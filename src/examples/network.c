@@ -0,0 +1,122 @@
+/* network.c: printing on a networked printer of the QL series
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../ql570.h"
+#include <stdlib.h>
+#include <errno.h>
+
+/**
+ * Raster line length for the QL-580N. The QL-1060N needs 162 bytes, see
+ * ql_model_lookup().
+ */
+#define BUFFER_SIZE 90
+
+/**
+ * Number of lines to print.
+ */
+#define LINES 300
+
+/**
+ * Example program for printing over the network.
+ *
+ * This is the same as `minimal.c`, but talks to the printer over a raw TCP
+ * connection (port 9100) and follows the printer status until the page is
+ * done.
+ *
+ * Usage: network <host> [port]
+ */
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <host> [port]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	char *port = argc > 2 ? argv[2] : "9100";
+
+	/*
+	 * Connect to the printer. Connecting, and waiting for the printer to
+	 * accept data or to answer, gives up after ten seconds.
+	 */
+	FILE *device = ql_net_open(argv[1], port, 10000);
+
+	if (device == NULL) {
+		fprintf(stderr, "Error while connecting to %s: %s\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	ql_status status = {0};
+	uint8_t buffer[BUFFER_SIZE];
+	ql_print_info print_info = {
+		.raster_number[0] = LINES & 0xFF,
+		.raster_number[1] = (LINES >> 8) & 0xFF
+	};
+
+	ql_init(false, device);
+
+	/*
+	 * The status request goes out together with the initialisation, the
+	 * status is read from the same connection.
+	 */
+	ql_status_request(device);
+
+	if (!ql_status_read(&status, device)) {
+		fprintf(stderr, "No status from printer.\n");
+		fclose(device);
+		return EXIT_FAILURE;
+	}
+
+	printf("Printer 0x%02x, media %dx%dmm.\n", status.printer_id,
+			status.media_width, status.media_length);
+
+	/*
+	 * Nothing of the page is sent before the first status read below,
+	 * unless it is larger than the send buffer. This way the printer gets
+	 * the whole page in one go.
+	 */
+	ql_page_start(&print_info, device);
+	ql_set_extended_options(true, false, device);
+
+	for (int i = 0; i < LINES; i++) {
+		memset(buffer, i % 5 == 0 ? 0xFF : 0x00, BUFFER_SIZE);
+		buffer[0] = 0x00;
+		buffer[1] = 0x00;
+		ql_raster(BUFFER_SIZE, buffer, device);
+	}
+
+	ql_raster_end(BUFFER_SIZE, device);
+	ql_page_end(true, device);
+
+	/*
+	 * Follow the printer until it is ready again or reports an error.
+	 */
+	while (ql_status_read(&status, device)) {
+		if (status.status_type == ST_ERROR) {
+			fprintf(stderr, "Printer reported error 0x%02x 0x%02x.\n",
+					status.error_info_1, status.error_info_2);
+			break;
+		}
+
+		if (status.status_type == ST_PHASE_CHANGE && status.phase_type == PT_WAITING)
+			break;
+	}
+
+	fclose(device);
+}
@@ -0,0 +1,310 @@
+/* font.c: bitmap fonts for drawing text into raster lines
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "font.h"
+
+/**
+ * The built-in font: 5x7 dots in a 6x8 cell, for the characters from space
+ * to underscore. Each line is given as five bits, most significant first.
+ */
+#define BUILTIN_FIRST 0x20
+#define BUILTIN_COUNT 64
+
+static const uint8_t builtin[BUILTIN_COUNT][7] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // space
+	{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 }, // !
+	{ 0x0A, 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00 }, // "
+	{ 0x0A, 0x0A, 0x1F, 0x0A, 0x1F, 0x0A, 0x0A }, // #
+	{ 0x04, 0x0F, 0x14, 0x0E, 0x05, 0x1E, 0x04 }, // $
+	{ 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 }, // %
+	{ 0x0C, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0D }, // &
+	{ 0x0C, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00 }, // '
+	{ 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 }, // (
+	{ 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 }, // )
+	{ 0x00, 0x04, 0x15, 0x0E, 0x15, 0x04, 0x00 }, // *
+	{ 0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00 }, // +
+	{ 0x00, 0x00, 0x00, 0x00, 0x0C, 0x04, 0x08 }, // ,
+	{ 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 }, // -
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C }, // .
+	{ 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 }, // /
+	{ 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E }, // 0
+	{ 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E }, // 1
+	{ 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F }, // 2
+	{ 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E }, // 3
+	{ 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 }, // 4
+	{ 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E }, // 5
+	{ 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E }, // 6
+	{ 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 }, // 7
+	{ 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E }, // 8
+	{ 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C }, // 9
+	{ 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00 }, // :
+	{ 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x04, 0x08 }, // ;
+	{ 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 }, // <
+	{ 0x00, 0x00, 0x1F, 0x00, 0x1F, 0x00, 0x00 }, // =
+	{ 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 }, // >
+	{ 0x0E, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 }, // ?
+	{ 0x0E, 0x11, 0x01, 0x0D, 0x15, 0x15, 0x0E }, // @
+	{ 0x0E, 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11 }, // A
+	{ 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E }, // B
+	{ 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E }, // C
+	{ 0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C }, // D
+	{ 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F }, // E
+	{ 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10 }, // F
+	{ 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F }, // G
+	{ 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 }, // H
+	{ 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E }, // I
+	{ 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C }, // J
+	{ 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 }, // K
+	{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F }, // L
+	{ 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 }, // M
+	{ 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 }, // N
+	{ 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E }, // O
+	{ 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 }, // P
+	{ 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D }, // Q
+	{ 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11 }, // R
+	{ 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E }, // S
+	{ 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, // T
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E }, // U
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04 }, // V
+	{ 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A }, // W
+	{ 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11 }, // X
+	{ 0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04 }, // Y
+	{ 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F }, // Z
+	{ 0x0E, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0E }, // [
+	{ 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 }, // backslash
+	{ 0x0E, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0E }, // ]
+	{ 0x04, 0x0A, 0x11, 0x00, 0x00, 0x00, 0x00 }, // ^
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F }, // _
+};
+
+/**
+ * Read a little endian 32 bit value from a PSF2 header.
+ */
+static uint32_t
+le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * Load the built-in font.
+ *
+ * The font only has upper case letters, ql_text_render() draws lower case
+ * letters with those.
+ *
+ * @param font font to initialise, release with ql_font_free()
+ * @returns false if out of memory
+ */
+bool
+ql_font_builtin(ql_font *font)
+{
+	font->width = 6;
+	font->height = 8;
+	font->stride = 1;
+	font->first = BUILTIN_FIRST;
+	font->count = BUILTIN_COUNT;
+	font->glyphs = calloc(BUILTIN_COUNT, font->height);
+
+	if (font->glyphs == NULL)
+		return false;
+
+	for (unsigned int i = 0; i < BUILTIN_COUNT; i++) {
+		for (unsigned int j = 0; j < 7; j++)
+			font->glyphs[i * font->height + j] = builtin[i][j] << 3;
+	}
+
+	return true;
+}
+
+/**
+ * Load a PC Screen Font (as used by the Linux console, version 1 or 2).
+ *
+ * Glyphs are taken to be in the order of their character codes, which holds
+ * for ASCII in the common fonts. The Unicode table is ignored.
+ *
+ * @param font font to initialise, release with ql_font_free()
+ * @param path file to load
+ * @returns false if the file could not be read or is not a PSF font
+ */
+bool
+ql_font_load(ql_font *font, const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	uint8_t header[32];
+	size_t offset;
+	size_t size;
+
+	if (file == NULL)
+		return false;
+
+	memset(font, 0x00, sizeof(ql_font));
+	size = fread(header, 1, sizeof(header), file);
+
+	if (size >= 4 && header[0] == 0x36 && header[1] == 0x04) {
+		// PSF1: 8 dots wide, 256 or 512 glyphs.
+		font->width = 8;
+		font->height = header[3];
+		font->count = header[2] & 0x01 ? 512 : 256;
+		offset = 4;
+	} else if (size == 32 && le32(header) == 0x864ab572) {
+		font->count = le32(header + 16);
+		font->height = le32(header + 24);
+		font->width = le32(header + 28);
+		offset = le32(header + 8);
+
+		if (le32(header + 20) != font->height * ((font->width + 7) / 8))
+			font->height = 0;
+	} else {
+		fclose(file);
+		return false;
+	}
+
+	font->stride = (font->width + 7) / 8;
+	size = (size_t)font->count * font->height * font->stride;
+
+	if (font->width == 0 || font->height == 0 || font->count == 0
+	    || font->width > 256 || font->height > 256 || font->count > 65536) {
+		fclose(file);
+		return false;
+	}
+
+	font->glyphs = malloc(size);
+
+	if (font->glyphs == NULL
+	    || fseek(file, offset, SEEK_SET) != 0
+	    || fread(font->glyphs, 1, size, file) != size) {
+		fclose(file);
+		ql_font_free(font);
+		return false;
+	}
+
+	fclose(file);
+
+	return true;
+}
+
+/**
+ * Enlarge all glyphs of a font.
+ *
+ * This is done once, so that text is drawn by copying glyph lines only.
+ *
+ * @param font the font
+ * @param sx factor across, at least 1
+ * @param sy factor along, at least 1
+ * @param scaled font to initialise with the enlarged glyphs, release with
+ *        ql_font_free()
+ * @returns false if out of memory
+ */
+bool
+ql_font_scale(const ql_font *font, unsigned int sx, unsigned int sy,
+		ql_font *scaled)
+{
+	if (sx == 0)
+		sx = 1;
+
+	if (sy == 0)
+		sy = 1;
+
+	*scaled = *font;
+	scaled->width = font->width * sx;
+	scaled->height = font->height * sy;
+	scaled->stride = (scaled->width + 7) / 8;
+	scaled->glyphs = calloc((size_t)font->count * scaled->height, scaled->stride);
+
+	if (scaled->glyphs == NULL)
+		return false;
+
+	for (uint32_t g = 0; g < font->count; g++) {
+		for (uint32_t y = 0; y < font->height; y++) {
+			const uint8_t *src = font->glyphs
+				+ ((size_t)g * font->height + y) * font->stride;
+			uint8_t *dst = scaled->glyphs
+				+ ((size_t)g * scaled->height + y * sy) * scaled->stride;
+
+			for (uint32_t x = 0; x < scaled->width; x++) {
+				uint32_t from = x / sx;
+
+				if (src[from / 8] & (0x80 >> (from % 8)))
+					dst[x / 8] |= 0x80 >> (x % 8);
+			}
+
+			for (uint32_t i = 1; i < sy; i++)
+				memcpy(dst + i * scaled->stride, dst, scaled->stride);
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Release a font.
+ *
+ * @param font font initialised with ql_font_builtin() or ql_font_load()
+ */
+void
+ql_font_free(ql_font *font)
+{
+	free(font->glyphs);
+	font->glyphs = NULL;
+}
+
+/**
+ * Draw a line of text.
+ *
+ * Glyphs are OR-ed into the bitmap one glyph line at a time. Characters the
+ * font has no glyph for are left blank.
+ *
+ * @param font the font
+ * @param text the text, one byte per character
+ * @param bitmap bitmap to initialise with the text, release with
+ *        ql_bitmap_free()
+ * @returns false if out of memory
+ */
+bool
+ql_text_render(const ql_font *font, const char *text, ql_bitmap *bitmap)
+{
+	size_t length = strlen(text);
+
+	if (!ql_bitmap_init(bitmap, length * font->width, font->height))
+		return false;
+
+	for (size_t i = 0; i < length; i++) {
+		uint32_t c = (uint8_t)text[i];
+
+		if (c - font->first >= font->count && c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+
+		if (c - font->first >= font->count)
+			continue;
+
+		const uint8_t *glyph = font->glyphs + (size_t)(c - font->first) * font->height * font->stride;
+
+		for (uint32_t y = 0; y < font->height; y++)
+			ql_blit_or(bitmap->data + y * bitmap->stride, i * font->width,
+					glyph + y * font->stride, font->stride, 0, font->width);
+	}
+
+	return true;
+}
@@ -0,0 +1,66 @@
+/* font.h: bitmap fonts for drawing text into raster lines
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _FONT_H_
+#define _FONT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "transform.h"
+
+typedef struct ql_font ql_font;
+struct ql_font {
+	/**
+	 * Size of a glyph cell in dots and lines. Every glyph has the same
+	 * size, spacing is part of the glyph.
+	 */
+	uint32_t width;
+	uint32_t height;
+
+	/**
+	 * Size of a glyph line in bytes.
+	 */
+	size_t stride;
+
+	/**
+	 * Character of the first glyph and number of glyphs.
+	 */
+	uint32_t first;
+	uint32_t count;
+
+	/**
+	 * All glyphs, one after the other, `height` lines of `stride` bytes
+	 * each, most significant bit first.
+	 */
+	uint8_t *glyphs;
+};
+
+bool ql_font_builtin(ql_font *font);
+bool ql_font_load(ql_font *font, const char *path);
+bool ql_font_scale(const ql_font *font, unsigned int sx, unsigned int sy,
+		ql_font *scaled);
+void ql_font_free(ql_font *font);
+
+bool ql_text_render(const ql_font *font, const char *text, ql_bitmap *bitmap);
+
+#endif
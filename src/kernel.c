@@ -0,0 +1,175 @@
+/* kernel.c: per-line work specialised for the common line lengths
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include "kernel.h"
+
+/**
+ * The kernels are written once, as functions that are always inlined. Each
+ * kernel calls them with its own line length, which the compiler then
+ * treats as a constant.
+ */
+#define KERNEL static inline __attribute__((always_inline))
+
+KERNEL uint64_t
+load64(const uint8_t *src)
+{
+	uint64_t word;
+	memcpy(&word, src, 8);
+
+	return word;
+}
+
+/**
+ * Number of bits set in a word.
+ *
+ * The builtin is a library call unless the target has an instruction for
+ * it, which the filter is not built for.
+ */
+KERNEL uint64_t
+popcount64(uint64_t word)
+{
+	word -= (word >> 1) & 0x5555555555555555ULL;
+	word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+	word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+
+	return (word * 0x0101010101010101ULL) >> 56;
+}
+
+/**
+ * Only clearing the line has a fixed size, see #ql_kernel.
+ */
+KERNEL void
+place_lines(const ql_placement *placement, const uint8_t *src, size_t src_len,
+		uint32_t count, uint8_t *heads, size_t length)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t *head = heads + i * length;
+
+		memset(head, 0x00, length);
+		ql_blit(head, placement->dst_bit, src + i * src_len, src_len,
+				placement->src_bit, placement->count);
+	}
+}
+
+KERNEL uint32_t
+count_line(const uint8_t *line, size_t length)
+{
+	uint64_t dots = 0;
+	uint64_t tail = 0;
+	size_t i = 0;
+
+	for (; i + 8 <= length; i += 8)
+		dots += popcount64(load64(line + i));
+
+	memcpy(&tail, line + i, length - i);
+
+	return dots + popcount64(tail);
+}
+
+KERNEL void
+encode_lines(const uint8_t *heads, uint32_t count, size_t length,
+		uint8_t *frames, uint32_t *dots)
+{
+	size_t frame_size = length + 3;
+
+	for (uint32_t i = 0; i < count; i++) {
+		const uint8_t *head = heads + i * length;
+		uint8_t *frame = frames + i * frame_size;
+
+		// Frames are not compressed, all of them are `frame_size` long.
+		if (i > 0 && memcmp(head, head - length, length) == 0) {
+			memcpy(frame, frame - frame_size, frame_size);
+			dots[i] = dots[i - 1];
+		} else {
+			frame[0] = 0x67;
+			frame[1] = 0x00;
+			frame[2] = length;
+			memcpy(frame + 3, head, length);
+			dots[i] = count_line(head, length);
+		}
+	}
+}
+
+/**
+ * Define a kernel for lines of `n` bytes.
+ */
+#define FIXED_KERNEL(n) \
+	static void \
+	place_##n(const ql_placement *placement, const uint8_t *src, \
+			size_t src_len, uint32_t count, uint8_t *heads, size_t length) \
+	{ \
+		(void)length; \
+		place_lines(placement, src, src_len, count, heads, n); \
+	} \
+	\
+	static void \
+	encode_##n(const uint8_t *heads, uint32_t count, size_t length, \
+			uint8_t *frames, uint32_t *dots) \
+	{ \
+		(void)length; \
+		encode_lines(heads, count, n, frames, dots); \
+	}
+
+// Most models have a print head of 720 dots, the wide ones of 1296 dots.
+FIXED_KERNEL(90)
+FIXED_KERNEL(162)
+
+static void
+place_any(const ql_placement *placement, const uint8_t *src, size_t src_len,
+		uint32_t count, uint8_t *heads, size_t length)
+{
+	place_lines(placement, src, src_len, count, heads, length);
+}
+
+static void
+encode_any(const uint8_t *heads, uint32_t count, size_t length,
+		uint8_t *frames, uint32_t *dots)
+{
+	encode_lines(heads, count, length, frames, dots);
+}
+
+static const ql_kernel kernels[] = {
+	{ 90,  "90 bytes",  place_90,  encode_90 },
+	{ 162, "162 bytes", place_162, encode_162 },
+	{ 0,   "generic",   place_any, encode_any }
+};
+
+/**
+ * Find the kernel for the raster lines of a printer.
+ *
+ * The resolution along the media only changes the number of lines, not the
+ * work done for each, so the length of the lines is all that matters.
+ *
+ * @param model the printer
+ * @return the kernel for lines of `model->bytes_per_line`, or the generic one
+ */
+const ql_kernel *
+ql_kernel_select(const ql_model *model)
+{
+	size_t i = 0;
+
+	while (kernels[i].line_length != 0 && kernels[i].line_length != model->bytes_per_line)
+		i++;
+
+	return &kernels[i];
+}
@@ -0,0 +1,77 @@
+/* kernel.h: per-line work specialised for the common line lengths
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef _KERNEL_H_
+#define _KERNEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ql570.h"
+#include "transform.h"
+
+/**
+ * Longest raster line, its length is sent in a single byte.
+ */
+#define QL_KERNEL_MAX_LINE UINT8_MAX
+
+/**
+ * The work done for every raster line of a page, once the input has been
+ * scaled: moving it into place for the print head, counting its dots and
+ * encoding it.
+ *
+ * Each function handles a batch of lines, `length` bytes each and stored one
+ * after the other. The kernels made for one line length ignore `length` and
+ * use their own, known at compile time, so that encoding and counting dots
+ * loop over a line with a fixed trip count. Placing only clears a line of
+ * fixed size, the dots are moved by ql_blit() for every kernel: it already
+ * shifts whole words, a copy specialised for the offsets of the media was
+ * not any faster.
+ */
+typedef struct ql_kernel ql_kernel;
+struct ql_kernel {
+	/**
+	 * Length of the lines handled, or 0 for any length.
+	 */
+	size_t line_length;
+	const char *name;
+
+	/**
+	 * Clear `heads` and place the input lines onto them, see ql_place().
+	 * This is the same ql_blit() for all kernels.
+	 */
+	void (*place)(const ql_placement *placement, const uint8_t *src,
+			size_t src_len, uint32_t count, uint8_t *heads, size_t length);
+
+	/**
+	 * Encode the lines as raster commands, as ql_raster() sends them, into
+	 * `frames`, `length + 3` bytes apart, and count their black dots. A
+	 * line repeating the one before is copied instead.
+	 */
+	void (*encode)(const uint8_t *heads, uint32_t count, size_t length,
+			uint8_t *frames, uint32_t *dots);
+};
+
+const ql_kernel *ql_kernel_select(const ql_model *model);
+
+#endif
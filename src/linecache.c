@@ -0,0 +1,196 @@
+/* linecache.c: placed raster lines by input line, for reuse
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "linecache.h"
+
+/**
+ * Set up an empty cache.
+ *
+ * @param cache cache to initialise, release with ql_line_cache_free()
+ * @param line_length length of a raster line for the print head
+ * @return false if out of memory
+ */
+bool
+ql_line_cache_init(ql_line_cache *cache, size_t line_length)
+{
+	memset(cache, 0x00, sizeof(ql_line_cache));
+	cache->line_length = line_length;
+	cache->hashes = calloc(QL_LINE_CACHE_SLOTS, sizeof(uint64_t));
+	cache->lines = malloc(QL_LINE_CACHE_SLOTS * line_length);
+	pthread_mutex_init(&cache->lock, NULL);
+
+	if (cache->hashes == NULL || cache->lines == NULL) {
+		ql_line_cache_free(cache);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Release a cache.
+ *
+ * @param cache cache initialised with ql_line_cache_init()
+ */
+void
+ql_line_cache_free(ql_line_cache *cache)
+{
+	free(cache->layout);
+	free(cache->hashes);
+	free(cache->keys);
+	free(cache->lines);
+	pthread_mutex_destroy(&cache->lock);
+	memset(cache, 0x00, sizeof(ql_line_cache));
+}
+
+/**
+ * Get ready for a page.
+ *
+ * Lines of earlier pages are kept if they were made the same way, i.e. with
+ * the same `layout`. Otherwise the cache is emptied.
+ *
+ * @param cache the cache, not in use by other threads
+ * @param layout whatever decides how an input line is turned into a raster
+ *        line, compared byte by byte
+ * @param layout_size size of `layout`
+ * @param key_length length of an input line in bytes
+ * @return false if out of memory, the cache must not be used for the page
+ */
+bool
+ql_line_cache_prepare(ql_line_cache *cache, const void *layout,
+		size_t layout_size, size_t key_length)
+{
+	if (cache->keys != NULL && cache->key_length == key_length
+	    && cache->layout_size == layout_size
+	    && memcmp(cache->layout, layout, layout_size) == 0)
+		return true;
+
+	free(cache->layout);
+	free(cache->keys);
+	cache->layout = malloc(layout_size);
+	cache->keys = malloc(QL_LINE_CACHE_SLOTS * key_length);
+	cache->layout_size = layout_size;
+	cache->key_length = key_length;
+	memset(cache->hashes, 0x00, QL_LINE_CACHE_SLOTS * sizeof(uint64_t));
+
+	if (cache->layout == NULL || cache->keys == NULL) {
+		free(cache->layout);
+		free(cache->keys);
+		cache->layout = NULL;
+		cache->keys = NULL;
+		return false;
+	}
+
+	memcpy(cache->layout, layout, layout_size);
+
+	return true;
+}
+
+/**
+ * Slot of a line in the cache. Bit 0 of the hash is always set, see
+ * ql_line_hash().
+ */
+static size_t
+slot_of(uint64_t hash)
+{
+	return (hash >> 1) & (QL_LINE_CACHE_SLOTS - 1);
+}
+
+/**
+ * Hash an input line.
+ *
+ * Lines are hashed eight bytes at a time. The result is never zero, which
+ * marks empty slots.
+ *
+ * @param line the input line
+ * @param length length of the line in bytes
+ * @return the hash
+ */
+uint64_t
+ql_line_hash(const uint8_t *line, size_t length)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL ^ length;
+	size_t i = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, line + i, 8);
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 29;
+	}
+
+	for (; i < length; i++)
+		hash = (hash ^ line[i]) * 0x100000001B3ULL;
+
+	hash ^= hash >> 32;
+
+	return hash | 1;
+}
+
+/**
+ * Look up the raster line for an input line. The caller holds
+ * `cache->lock`.
+ *
+ * @param cache the cache
+ * @param hash hash of the input line, see ql_line_hash()
+ * @param key the input line, `cache->key_length` bytes
+ * @param line filled with the raster line, `cache->line_length` bytes
+ * @return false if the line is not in the cache
+ */
+bool
+ql_line_cache_get(ql_line_cache *cache, uint64_t hash, const uint8_t *key,
+		uint8_t *line)
+{
+	size_t slot = slot_of(hash);
+
+	cache->lookups++;
+
+	if (cache->hashes[slot] != hash
+	    || memcmp(cache->keys + slot * cache->key_length, key, cache->key_length) != 0)
+		return false;
+
+	memcpy(line, cache->lines + slot * cache->line_length, cache->line_length);
+	cache->hits++;
+
+	return true;
+}
+
+/**
+ * Add the raster line for an input line, replacing a line with a similar
+ * hash. The caller holds `cache->lock`.
+ *
+ * @param cache the cache
+ * @param hash hash of the input line, see ql_line_hash()
+ * @param key the input line, `cache->key_length` bytes
+ * @param line the raster line, `cache->line_length` bytes
+ */
+void
+ql_line_cache_put(ql_line_cache *cache, uint64_t hash, const uint8_t *key,
+		const uint8_t *line)
+{
+	size_t slot = slot_of(hash);
+
+	cache->hashes[slot] = hash;
+	memcpy(cache->keys + slot * cache->key_length, key, cache->key_length);
+	memcpy(cache->lines + slot * cache->line_length, line, cache->line_length);
+}
@@ -0,0 +1,84 @@
+/* linecache.h: placed raster lines by input line, for reuse
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _LINECACHE_H_
+#define _LINECACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * Number of lines kept, a power of two. Labels tend to repeat a few lines
+ * (borders, bars, blank space) many times, rather than many different ones.
+ */
+#define QL_LINE_CACHE_SLOTS 1024
+
+/**
+ * Raster lines for the print head, looked up by the input line they were
+ * made from. This only works as long as each output line is made from one
+ * input line, the same way every time, see ql_line_cache_prepare().
+ */
+typedef struct ql_line_cache ql_line_cache;
+struct ql_line_cache {
+	/**
+	 * How input lines are turned into raster lines, as given to
+	 * ql_line_cache_prepare().
+	 */
+	void *layout;
+	size_t layout_size;
+
+	size_t key_length;
+	size_t line_length;
+
+	/**
+	 * Per slot: hash of the input line (zero if empty), the input line
+	 * itself and the raster line made from it.
+	 */
+	uint64_t *hashes;
+	uint8_t *keys;
+	uint8_t *lines;
+
+	/**
+	 * Taken around ql_line_cache_get() and ql_line_cache_put(), the cache
+	 * is shared by all worker threads.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * Number of lines found, and looked up.
+	 */
+	uint64_t hits;
+	uint64_t lookups;
+};
+
+bool ql_line_cache_init(ql_line_cache *cache, size_t line_length);
+void ql_line_cache_free(ql_line_cache *cache);
+bool ql_line_cache_prepare(ql_line_cache *cache, const void *layout,
+		size_t layout_size, size_t key_length);
+uint64_t ql_line_hash(const uint8_t *line, size_t length);
+bool ql_line_cache_get(ql_line_cache *cache, uint64_t hash, const uint8_t *key,
+		uint8_t *line);
+void ql_line_cache_put(ql_line_cache *cache, uint64_t hash, const uint8_t *key,
+		const uint8_t *line);
+
+#endif
@@ -0,0 +1,334 @@
+/* metrics.c: lifetime counters of a printer
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "ql570.h"
+#include "metrics.h"
+
+static const struct {
+	uint8_t info;
+	uint8_t bit;
+	const char *name;
+} error_bits[QL_METRICS_ERRORS] = {
+	{ 1, NO_MEDIA,           "no_media" },
+	{ 1, END_OF_MEDIA,       "end_of_media" },
+	{ 1, TAPE_CUTTER_JAM,    "tape_cutter_jam" },
+	{ 1, MAIN_UNIT_IN_USE,   "main_unit_in_use" },
+	{ 1, FAN_MALFUNCTION,    "fan_malfunction" },
+	{ 2, WRONG_MEDIA,        "wrong_media" },
+	{ 2, TRANSMISSION_ERROR, "transmission_error" },
+	{ 2, COVER_OPENED,       "cover_opened" },
+	{ 2, CANNOT_FEED,        "cannot_feed" },
+	{ 2, SYSTEM_ERROR,       "system_error" }
+};
+
+/**
+ * Counters kept in the state file, by name.
+ */
+static const struct {
+	const char *name;
+	size_t offset;
+} counters[] = {
+	{ "labels",       offsetof(ql_metrics, labels) },
+	{ "lines",        offsetof(ql_metrics, lines) },
+	{ "tape_um",      offsetof(ql_metrics, tape_um) },
+	{ "bytes",        offsetof(ql_metrics, bytes) },
+	{ "cooling",      offsetof(ql_metrics, cooling) },
+	{ "init_retries", offsetof(ql_metrics, init_retries) },
+	{ "short_reads",  offsetof(ql_metrics, short_reads) }
+};
+
+#define COUNTER(metrics, i) (*(uint64_t *)((char *)(metrics) + counters[i].offset))
+
+/**
+ * Count the error bits of an error status.
+ *
+ * @param metrics the counters
+ * @param error_info_1 as in ql_status.error_info_1
+ * @param error_info_2 as in ql_status.error_info_2
+ */
+void
+ql_metrics_error(ql_metrics *metrics, uint8_t error_info_1, uint8_t error_info_2)
+{
+	for (unsigned int i = 0; i < QL_METRICS_ERRORS; i++) {
+		uint8_t info = error_bits[i].info == 1 ? error_info_1 : error_info_2;
+
+		if (info & error_bits[i].bit)
+			metrics->errors[i]++;
+	}
+}
+
+/**
+ * Name of an error bit, as used in the state file and for export.
+ *
+ * @param index index into ql_metrics.errors
+ * @return the name, e.g. "cover_opened"
+ */
+const char *
+ql_metrics_error_name(unsigned int index)
+{
+	return index < QL_METRICS_ERRORS ? error_bits[index].name : NULL;
+}
+
+/**
+ * Read counters saved with ql_metrics_save().
+ *
+ * A missing file is not an error, the counters are zero then. Unknown lines
+ * are skipped, so older versions can read files of newer ones.
+ *
+ * @param metrics filled with the counters
+ * @param speed filled with the measured speed
+ * @param path state file
+ * @return false if the file exists but could not be read
+ */
+bool
+ql_metrics_load(ql_metrics *metrics, ql_speed *speed, const char *path)
+{
+	memset(metrics, 0x00, sizeof(ql_metrics));
+	memset(speed, 0x00, sizeof(ql_speed));
+
+	FILE *file = fopen(path, "r");
+
+	if (file == NULL)
+		return access(path, F_OK) != 0;
+
+	char line[128];
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char name[64];
+		uint64_t value;
+		unsigned int printer_id, resolution, samples, outliers = 0;
+		double lines_per_second, outlier_lines_per_second = 0;
+
+		// Outliers were added later, older files do not have them.
+		if (sscanf(line, "speed %u %u %lf %u %lf %u", &printer_id, &resolution,
+					&lines_per_second, &samples, &outlier_lines_per_second,
+					&outliers) >= 4) {
+			if (outlier_lines_per_second <= 0)
+				outliers = 0;
+
+			if (speed->count < QL_SPEED_ENTRIES && lines_per_second > 0)
+				speed->entries[speed->count++] = (ql_speed_entry) {
+					.printer_id = printer_id,
+					.resolution = resolution,
+					.lines_per_second = lines_per_second,
+					.samples = samples,
+					.outlier_lines_per_second = outlier_lines_per_second,
+					.outliers = outliers
+				};
+			continue;
+		}
+
+		if (sscanf(line, "%63s %" SCNu64, name, &value) != 2)
+			continue;
+
+		for (unsigned int i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+			if (strcmp(name, counters[i].name) == 0)
+				COUNTER(metrics, i) = value;
+
+		for (unsigned int i = 0; i < QL_METRICS_ERRORS; i++)
+			if (strncmp(name, "error_", 6) == 0 && strcmp(name + 6, error_bits[i].name) == 0)
+				metrics->errors[i] = value;
+	}
+
+	bool ok = !ferror(file);
+	fclose(file);
+
+	return ok;
+}
+
+/**
+ * Replace a file, so that readers see either the old or the new contents.
+ *
+ * The contents are written to a temporary file next to `path`, which is then
+ * renamed.
+ *
+ * @param path file to replace
+ * @param write writes the contents
+ * @param arg passed to `write`
+ * @return false if the file could not be written
+ */
+static bool
+replace_file(const char *path, void (*write)(FILE *, const void *), const void *arg)
+{
+	char temp[4096];
+
+	if (snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(temp))
+		return false;
+
+	FILE *file = fopen(temp, "w");
+
+	if (file == NULL)
+		return false;
+
+	write(file, arg);
+
+	bool ok = fflush(file) == 0 && !ferror(file) && fsync(fileno(file)) == 0;
+
+	if (fclose(file) != 0)
+		ok = false;
+
+	if (ok && rename(temp, path) == 0)
+		return true;
+
+	unlink(temp);
+
+	return false;
+}
+
+typedef struct state state;
+struct state {
+	const ql_metrics *metrics;
+	const ql_speed *speed;
+	const char *printer;
+};
+
+static void
+write_state(FILE *file, const void *arg)
+{
+	const state *s = arg;
+
+	for (unsigned int i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+		fprintf(file, "%s %" PRIu64 "\n", counters[i].name, COUNTER(s->metrics, i));
+
+	for (unsigned int i = 0; i < QL_METRICS_ERRORS; i++)
+		fprintf(file, "error_%s %" PRIu64 "\n", error_bits[i].name, s->metrics->errors[i]);
+
+	for (unsigned int i = 0; i < s->speed->count; i++) {
+		const ql_speed_entry *entry = &s->speed->entries[i];
+
+		fprintf(file, "speed %u %u %.3f %u %.3f %u\n", entry->printer_id,
+				entry->resolution, entry->lines_per_second, entry->samples,
+				entry->outlier_lines_per_second, entry->outliers);
+	}
+}
+
+/**
+ * Save the counters and the measured speed.
+ *
+ * The file is replaced atomically, a job that is cancelled while saving
+ * leaves the previous state behind.
+ *
+ * @param metrics the counters
+ * @param speed the measured speed
+ * @param path state file
+ * @return false if the file could not be written
+ */
+bool
+ql_metrics_save(const ql_metrics *metrics, const ql_speed *speed, const char *path)
+{
+	return replace_file(path, write_state, &(state){ metrics, speed, NULL });
+}
+
+static void
+write_label(FILE *file, const char *printer)
+{
+	fputs("printer=\"", file);
+
+	for (const char *c = printer; *c != '\0'; c++) {
+		if (*c == '\\' || *c == '"')
+			fputc('\\', file);
+
+		if (*c == '\n')
+			fputs("\\n", file);
+		else
+			fputc(*c, file);
+	}
+
+	fputc('"', file);
+}
+
+static void
+write_counter(FILE *file, const char *printer, const char *name, const char *help,
+		uint64_t value)
+{
+	fprintf(file, "# HELP ql_%s %s\n# TYPE ql_%s counter\nql_%s{", name, help, name, name);
+	write_label(file, printer);
+	fprintf(file, "} %" PRIu64 "\n", value);
+}
+
+static void
+write_export(FILE *file, const void *arg)
+{
+	const state *s = arg;
+	const ql_metrics *m = s->metrics;
+
+	write_counter(file, s->printer, "labels_total", "Labels printed.", m->labels);
+	write_counter(file, s->printer, "lines_total", "Raster lines printed.", m->lines);
+	write_counter(file, s->printer, "bytes_total", "Bytes sent to the printer.", m->bytes);
+
+	fprintf(file, "# HELP ql_tape_meters_total Media used for printed labels.\n"
+			"# TYPE ql_tape_meters_total counter\nql_tape_meters_total{");
+	write_label(file, s->printer);
+	fprintf(file, "} %.6f\n", m->tape_um / 1e6);
+
+	write_counter(file, s->printer, "cooling_total",
+			"Times the printer stopped to cool down.", m->cooling);
+	write_counter(file, s->printer, "init_retries_total",
+			"Times the printer did not answer the first initialisation.", m->init_retries);
+	write_counter(file, s->printer, "short_reads_total",
+			"Status reads that timed out or were incomplete.", m->short_reads);
+
+	fprintf(file, "# HELP ql_errors_total Errors reported by the printer.\n"
+			"# TYPE ql_errors_total counter\n");
+
+	for (unsigned int i = 0; i < QL_METRICS_ERRORS; i++) {
+		fputs("ql_errors_total{", file);
+		write_label(file, s->printer);
+		fprintf(file, ",error=\"%s\"} %" PRIu64 "\n", error_bits[i].name, m->errors[i]);
+	}
+
+	fprintf(file, "# HELP ql_print_speed_lines_per_second Measured print speed.\n"
+			"# TYPE ql_print_speed_lines_per_second gauge\n");
+
+	for (unsigned int i = 0; i < s->speed->count; i++) {
+		const ql_speed_entry *entry = &s->speed->entries[i];
+		const ql_model *model = ql_model_lookup(entry->printer_id);
+
+		fputs("ql_print_speed_lines_per_second{", file);
+		write_label(file, s->printer);
+		fprintf(file, ",model=\"%s\",resolution=\"%u\"} %.1f\n", model->name,
+				entry->resolution, entry->lines_per_second);
+	}
+}
+
+/**
+ * Export the counters in the Prometheus text format, e.g. for the textfile
+ * collector of the node exporter.
+ *
+ * The file is replaced atomically, so the exporter never reads half of it.
+ *
+ * @param metrics the counters
+ * @param speed the measured speed
+ * @param printer name of the printer, used as label
+ * @param path file to write, should end in `.prom`
+ * @return false if the file could not be written
+ */
+bool
+ql_metrics_export(const ql_metrics *metrics, const ql_speed *speed,
+		const char *printer, const char *path)
+{
+	return replace_file(path, write_export, &(state){ metrics, speed, printer });
+}
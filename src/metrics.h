@@ -0,0 +1,84 @@
+/* metrics.h: lifetime counters of a printer
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "speed.h"
+
+/**
+ * Number of error bits counted, see ql_metrics_error().
+ */
+#define QL_METRICS_ERRORS 10
+
+typedef struct ql_metrics ql_metrics;
+struct ql_metrics {
+	/**
+	 * Labels (pages) the printer completed.
+	 */
+	uint64_t labels;
+
+	/**
+	 * Raster lines of completed labels and the length of media they used,
+	 * in micrometres.
+	 */
+	uint64_t lines;
+	uint64_t tape_um;
+
+	/**
+	 * Bytes sent to the printer, including pages sent again.
+	 */
+	uint64_t bytes;
+
+	/**
+	 * How often each error bit was reported, in the order of
+	 * ql_metrics_error_name().
+	 */
+	uint64_t errors[QL_METRICS_ERRORS];
+
+	/**
+	 * Times the printer stopped to cool down.
+	 */
+	uint64_t cooling;
+
+	/**
+	 * Times the printer had to be initialised again, as it did not answer.
+	 */
+	uint64_t init_retries;
+
+	/**
+	 * Status reads that timed out, came up short or were invalid while
+	 * waiting for a page. Reads failing in a row are counted once.
+	 */
+	uint64_t short_reads;
+};
+
+void ql_metrics_error(ql_metrics *metrics, uint8_t error_info_1, uint8_t error_info_2);
+const char *ql_metrics_error_name(unsigned int index);
+bool ql_metrics_load(ql_metrics *metrics, ql_speed *speed, const char *path);
+bool ql_metrics_save(const ql_metrics *metrics, const ql_speed *speed, const char *path);
+bool ql_metrics_export(const ql_metrics *metrics, const ql_speed *speed,
+		const char *printer, const char *path);
+
+#endif
@@ -0,0 +1,188 @@
+/* pool.c: a small pool of worker threads
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+typedef struct ql_task ql_task;
+struct ql_task {
+	ql_task_fn fn;
+	void *arg;
+	ql_task *next;
+};
+
+struct ql_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+
+	/**
+	 * Pending tasks. Tasks are started in the order they were submitted.
+	 */
+	ql_task *head;
+	ql_task *tail;
+
+	bool shutdown;
+
+	unsigned int size;
+	pthread_t threads[];
+};
+
+/**
+ * Main loop of a worker thread.
+ */
+static void *
+ql_pool_worker(void *arg)
+{
+	ql_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		while (pool->head == NULL && !pool->shutdown)
+			pthread_cond_wait(&pool->wakeup, &pool->lock);
+
+		if (pool->head == NULL)
+			break;
+
+		ql_task *task = pool->head;
+		pool->head = task->next;
+
+		if (pool->head == NULL)
+			pool->tail = NULL;
+
+		pthread_mutex_unlock(&pool->lock);
+		task->fn(task->arg);
+		free(task);
+		pthread_mutex_lock(&pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/**
+ * Start a pool of worker threads.
+ *
+ * @param threads number of threads, at least one
+ * @return the pool, or NULL if no thread could be started
+ */
+ql_pool *
+ql_pool_create(unsigned int threads)
+{
+	if (threads == 0)
+		threads = 1;
+
+	ql_pool *pool = calloc(1, sizeof(ql_pool) + threads * sizeof(pthread_t));
+
+	if (pool == NULL)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wakeup, NULL);
+
+	for (unsigned int i = 0; i < threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, ql_pool_worker, pool) != 0)
+			break;
+
+		pool->size++;
+	}
+
+	if (pool->size == 0) {
+		ql_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/**
+ * Queue a task.
+ *
+ * Tasks are picked up in the order they were submitted. A task may therefore
+ * wait for a task submitted before it, but never for one submitted after it.
+ *
+ * @param pool the pool
+ * @param fn function to run on a worker thread
+ * @param arg argument passed to `fn`
+ * @return false if out of memory
+ */
+bool
+ql_pool_submit(ql_pool *pool, ql_task_fn fn, void *arg)
+{
+	ql_task *task = malloc(sizeof(ql_task));
+
+	if (task == NULL)
+		return false;
+
+	task->fn = fn;
+	task->arg = arg;
+	task->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->tail != NULL)
+		pool->tail->next = task;
+	else
+		pool->head = task;
+
+	pool->tail = task;
+
+	pthread_cond_signal(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+
+	return true;
+}
+
+/**
+ * Number of worker threads.
+ */
+unsigned int
+ql_pool_size(const ql_pool *pool)
+{
+	return pool->size;
+}
+
+/**
+ * Finish all pending tasks and stop the worker threads.
+ *
+ * @param pool the pool, may be NULL
+ */
+void
+ql_pool_destroy(ql_pool *pool)
+{
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned int i = 0; i < pool->size; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wakeup);
+	free(pool);
+}
@@ -0,0 +1,36 @@
+/* pool.h: a small pool of worker threads
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdbool.h>
+
+typedef void (*ql_task_fn)(void *arg);
+
+typedef struct ql_pool ql_pool;
+
+ql_pool *ql_pool_create(unsigned int threads);
+bool ql_pool_submit(ql_pool *pool, ql_task_fn fn, void *arg);
+unsigned int ql_pool_size(const ql_pool *pool);
+void ql_pool_destroy(ql_pool *pool);
+
+#endif
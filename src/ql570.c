@@ -18,8 +18,25 @@
  * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include "ql570.h"
 
+/**
+ * Amount of data collected before it is sent to a networked printer.
+ */
+#define QL_NET_CHUNK (64 * 1024)
+
 /**
  * Request status from printer.
  *
@@ -42,9 +59,14 @@ ql_status_request(FILE *device)
 bool
 ql_status_read(ql_status *status, FILE *device)
 {
+	// Make sure the request went out, this is also required before
+	// switching from writing to reading on streams opened for both.
+	fflush(device);
+
 	size_t len = fread(status, sizeof(ql_status), 1, device);
 
-	if (len != sizeof(ql_status)) {
+	if (len != 1) {
+		clearerr(device);
 		return false;
 	}
 
@@ -212,6 +234,21 @@ ql_autocut_enable(FILE *device)
 	fwrite(request, 4, 1, device);
 }
 
+/**
+ * Disable automatic label cutting.
+ *
+ * Labels are only cut at the end of the job then, if requested with
+ * ql_set_extended_options().
+ *
+ * @param device file descriptor to write to
+ */
+void
+ql_autocut_disable(FILE *device)
+{
+	uint8_t request[4] = {QL_ESC, 0x69, 0x4D, 0x00};
+	fwrite(request, 4, 1, device);
+}
+
 /**
  * Cut after each _n_ labels.
  *
@@ -268,3 +305,354 @@ ql_set_margins(uint16_t margins, FILE *device)
 	uint8_t request[5] = {QL_ESC, 0x69, 0x64, margins & 0x00FF, (margins & 0xFF00) >> 8};
 	fwrite(request, 5, 1, device);
 }
+
+/**
+ * Known printer models.
+ *
+ * The first entry doubles as the fallback for unknown printers (QL_OTHER), it
+ * describes the QL-570, which is the only printer this has been tested with.
+ */
+static const ql_model ql_models[] = {
+	{ QL_570,     "QL-570",      90, 150,  0 },
+	{ QL_500_550, "QL-500/550",  90, 295,  0 },
+	{ QL_560,     "QL-560",      90, 295,  0 },
+	{ QL_580N,    "QL-580N",     90, 150,  0 },
+	{ QL_650TD,   "QL-650TD",    90, 295,  0 },
+	{ QL_700,     "QL-700",      90, 150,  0 },
+	{ QL_1050,    "QL-1050",    162, 295, 44 },
+	{ QL_1060N,   "QL-1060N",   162, 295, 44 }
+};
+
+/**
+ * Known media and the position of their printable area on the print head.
+ *
+ * The specification only lists the margins for each label in prose, this
+ * table follows the values used by other drivers for the QL series. The
+ * offsets are measured from the start of the raster line, i.e. the side of
+ * the print head at which the media guide is located.
+ */
+static const ql_media ql_media_table[] = {
+	/* Continuous tape */
+	{ 12,  0, 142, 106, 29 },
+	{ 29,  0, 342, 306,  6 },
+	{ 38,  0, 449, 413, 12 },
+	{ 50,  0, 590, 554, 12 },
+	{ 54,  0, 636, 590,  0 },
+	{ 62,  0, 732, 696, 12 },
+
+	/* Die-cut labels */
+	{ 17, 54, 201, 165,  0 },
+	{ 17, 87, 201, 165,  0 },
+	{ 23, 23, 272, 202, 42 },
+	{ 29, 42, 342, 306,  6 },
+	{ 29, 90, 342, 306,  6 },
+	{ 38, 90, 449, 413, 12 },
+	{ 39, 48, 461, 425,  6 },
+	{ 52, 29, 614, 578,  0 },
+	{ 62, 29, 732, 696, 12 },
+	{ 62,100, 732, 696, 12 },
+
+	/* Round die-cut labels */
+	{ 12, 12, 142,  94, 113 },
+	{ 24, 24, 284, 236,  42 },
+	{ 58, 58, 688, 618,  51 }
+};
+
+/**
+ * Find the model description for a printer.
+ *
+ * @param printer_id printer id as reported in ql_status.printer_id
+ * @return the model description, falls back to the QL-570 for unknown ids
+ */
+const ql_model *
+ql_model_lookup(uint8_t printer_id)
+{
+	size_t count = sizeof(ql_models) / sizeof(ql_models[0]);
+
+	for (size_t i = 0; i < count; i++) {
+		if (ql_models[i].printer_id == printer_id)
+			return &ql_models[i];
+	}
+
+	return &ql_models[0];
+}
+
+/**
+ * Find the placement of the printable area for the loaded media.
+ *
+ * @param width media width as reported in ql_status.media_width
+ * @param length media length as reported in ql_status.media_length
+ * @return the media description or NULL if the media is not known
+ */
+const ql_media *
+ql_media_lookup(uint8_t width, uint8_t length)
+{
+	size_t count = sizeof(ql_media_table) / sizeof(ql_media_table[0]);
+
+	for (size_t i = 0; i < count; i++) {
+		if (ql_media_table[i].width == width
+		    && ql_media_table[i].length == length)
+			return &ql_media_table[i];
+	}
+
+	return NULL;
+}
+
+typedef struct ql_net ql_net;
+struct ql_net {
+	int fd;
+	int timeout;
+
+	/**
+	 * Commands waiting to be sent.
+	 */
+	uint8_t *pending;
+	size_t pending_len;
+};
+
+/**
+ * Wait for a socket to become ready.
+ *
+ * @return false on timeout or error
+ */
+static bool
+ql_net_wait(ql_net *net, short events)
+{
+	struct pollfd pfd = { .fd = net->fd, .events = events };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, net->timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret > 0 && !(pfd.revents & (POLLERR | POLLNVAL));
+}
+
+/**
+ * Connect a non-blocking socket.
+ *
+ * @param fd the socket
+ * @param address address to connect to
+ * @param length length of `address`
+ * @param timeout timeout in milliseconds
+ * @return false on timeout or error (see errno)
+ */
+static bool
+ql_net_connect(int fd, const struct sockaddr *address, socklen_t length, int timeout)
+{
+	if (connect(fd, address, length) == 0)
+		return true;
+
+	if (errno != EINPROGRESS)
+		return false;
+
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret == 0)
+		errno = ETIMEDOUT;
+
+	if (ret <= 0)
+		return false;
+
+	int error = 0;
+	socklen_t size = sizeof(error);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0)
+		return false;
+
+	errno = error;
+
+	return error == 0;
+}
+
+/**
+ * Send data, waiting whenever the socket's buffer is full.
+ */
+static bool
+ql_net_send(ql_net *net, const uint8_t *data, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t ret = send(net->fd, data + done, size - done, MSG_NOSIGNAL);
+
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+		    && ql_net_wait(net, POLLOUT))
+			continue;
+
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Send all pending commands.
+ */
+static bool
+ql_net_flush(ql_net *net)
+{
+	bool ok = ql_net_send(net, net->pending, net->pending_len);
+	net->pending_len = 0;
+
+	return ok;
+}
+
+static ssize_t
+ql_net_write(void *cookie, const char *data, size_t size)
+{
+	ql_net *net = cookie;
+
+	if (net->pending_len + size > QL_NET_CHUNK && !ql_net_flush(net))
+		return -1;
+
+	if (size >= QL_NET_CHUNK)
+		return ql_net_send(net, (const uint8_t *)data, size) ? (ssize_t)size : -1;
+
+	memcpy(net->pending + net->pending_len, data, size);
+	net->pending_len += size;
+
+	return size;
+}
+
+static ssize_t
+ql_net_read(void *cookie, char *data, size_t size)
+{
+	ql_net *net = cookie;
+
+	// The printer only answers once it has seen everything we have to
+	// say.
+	if (!ql_net_flush(net))
+		return -1;
+
+	for (;;) {
+		ssize_t ret = recv(net->fd, data, size, 0);
+
+		if (ret >= 0)
+			return ret;
+
+		if (errno == EINTR)
+			continue;
+
+		if ((errno == EAGAIN || errno == EWOULDBLOCK) && ql_net_wait(net, POLLIN))
+			continue;
+
+		return -1;
+	}
+}
+
+static int
+ql_net_close(void *cookie)
+{
+	ql_net *net = cookie;
+	bool ok = ql_net_flush(net);
+
+	close(net->fd);
+	free(net->pending);
+	free(net);
+
+	return ok ? 0 : -1;
+}
+
+/**
+ * Connect to a networked printer.
+ *
+ * Printers with a network interface (e.g. the QL-580N and QL-1060N) accept
+ * the same commands on a raw TCP socket, usually on port 9100, and answer
+ * status requests on the same connection.
+ *
+ * The returned stream collects commands and sends them in large chunks, or
+ * when a status is read (see ql_status_read()), so that all commands of a page
+ * are pipelined before we wait for the printer. The socket is non-blocking,
+ * `timeout` applies to connecting and to each wait for the printer to accept
+ * or return data.
+ *
+ * @param host host name or address of the printer
+ * @param port port, e.g. "9100"
+ * @param timeout timeout in milliseconds
+ * @return stream to read from and write to, or NULL on error (see errno)
+ */
+FILE *
+ql_net_open(const char *host, const char *port, int timeout)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	struct addrinfo *result;
+	int fd = -1;
+
+	if (getaddrinfo(host, port, &hints, &result) != 0) {
+		errno = EHOSTUNREACH;
+		return NULL;
+	}
+
+	for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+		if (fd < 0)
+			continue;
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		if (ql_net_connect(fd, ai->ai_addr, ai->ai_addrlen, timeout))
+			break;
+
+		int error = errno;
+		close(fd);
+		errno = error;
+		fd = -1;
+	}
+
+	freeaddrinfo(result);
+
+	if (fd < 0)
+		return NULL;
+
+	// Commands are collected in QL_NET_CHUNK anyway, status requests
+	// should not wait for more data to be sent.
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	ql_net *net = calloc(1, sizeof(ql_net));
+	cookie_io_functions_t functions = {
+		.read = ql_net_read,
+		.write = ql_net_write,
+		.close = ql_net_close
+	};
+	FILE *device = NULL;
+
+	if (net != NULL) {
+		net->fd = fd;
+		net->timeout = timeout;
+		net->pending = malloc(QL_NET_CHUNK);
+	}
+
+	if (net != NULL && net->pending != NULL)
+		device = fopencookie(net, "r+", functions);
+
+	if (device == NULL) {
+		close(fd);
+
+		if (net != NULL)
+			free(net->pending);
+
+		free(net);
+		errno = ENOMEM;
+	}
+
+	return device;
+}
@@ -283,6 +283,71 @@ struct ql_status {
 	uint8_t _reserved25[8];
 };
 
+typedef struct ql_model ql_model;
+struct ql_model {
+	/**
+	 * See #ql_printer_type.
+	 */
+	uint8_t printer_id;
+
+	const char *name;
+
+	/**
+	 * Length of one raster line in bytes. This is the width of the print
+	 * head, i.e. 90 bytes (720 pins) for most printers in the QL series
+	 * and 162 bytes (1296 pins) for the wide models.
+	 */
+	uint8_t bytes_per_line;
+
+	/**
+	 * Minimum number of raster lines on a page.
+	 */
+	uint16_t min_lines;
+
+	/**
+	 * Additional offset (in dots) of the media, relative to the offsets
+	 * given in #ql_media. The wide models place all media further into
+	 * the print head.
+	 */
+	uint16_t offset;
+};
+
+typedef struct ql_media ql_media;
+struct ql_media {
+	/**
+	 * Width of the media in millimetres, as reported in
+	 * ql_status.media_width.
+	 */
+	uint8_t width;
+
+	/**
+	 * Length of the media in millimetres, as reported in
+	 * ql_status.media_length, or zero for continuous tape.
+	 */
+	uint8_t length;
+
+	/**
+	 * Width of the media in dots (at 300 dpi).
+	 */
+	uint16_t dots;
+
+	/**
+	 * Number of dots the printer is able to print on.
+	 */
+	uint16_t printable;
+
+	/**
+	 * Position of the first printable dot in the raster line, counted
+	 * from the most significant bit of the first byte.
+	 */
+	uint16_t offset;
+};
+
+const ql_model *ql_model_lookup(uint8_t printer_id);
+const ql_media *ql_media_lookup(uint8_t width, uint8_t length);
+
+FILE *ql_net_open(const char *host, const char *port, int timeout);
+
 void ql_init(bool flush, FILE* device);
 void ql_status_request(FILE* device);
 bool ql_status_read(ql_status* status, FILE* device);
@@ -293,6 +358,7 @@ void ql_page_start(ql_print_info* print_info, FILE* device);
 void ql_page_end(bool last_page, FILE* device);
 void ql_set_extended_options(bool cutAtEnd, bool highResolution, FILE* device);
 void ql_autocut_enable(FILE* device);
+void ql_autocut_disable(FILE* device);
 void ql_autocut_interval(uint8_t interval, FILE* device);
 void ql_set_default_margins(enum ql_media_type, FILE* device);
 void ql_set_margins(uint16_t margins, FILE* device);
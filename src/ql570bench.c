@@ -0,0 +1,372 @@
+/* ql570bench.c: measure the latency of the filter against a status trace
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cups/cups.h>
+#include <cups/raster.h>
+#include "ql570.h"
+#include "trace.h"
+
+/**
+ * Largest number of runs, see -n.
+ */
+#define MAX_RUNS 100
+
+/**
+ * Page size used when the media cannot be taken from the trace.
+ */
+#define DEFAULT_WIDTH 696
+#define DEFAULT_LINES 600
+
+typedef struct settings settings;
+struct settings {
+	const char *filter;
+	const char *trace;
+	const char *options;
+	unsigned int runs;
+	unsigned int pages;
+	unsigned int width;
+	unsigned int lines;
+	bool verbose;
+};
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] filter trace\n"
+		"\n"
+		"Runs the filter on generated pages, with the status of the printer\n"
+		"replayed from a trace recorded with QL_TRACE_RECORD, and reports how\n"
+		"long the job took.\n"
+		"\n"
+		"  -n runs       number of runs, the median is reported (default: 5)\n"
+		"  -p pages      pages per job (default: 3)\n"
+		"  -l lines      lines per page at 300dpi (default: the length of the\n"
+		"                die-cut labels in the trace, otherwise 600)\n"
+		"  -o options    job options passed to the filter\n"
+		"  -t seconds    fail if the median is above this\n"
+		"  -b file       fail if the median is above the one stored in the file\n"
+		"  -x percent    tolerance for -b (default: 10)\n"
+		"  -w            store the median in the file given with -b instead\n"
+		"  -v            show the messages of the filter\n",
+		name);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Size the pages for the media loaded when the trace was recorded.
+ *
+ * The first status in the trace is the reply to the status request of the
+ * filter. Pages span the printable width of the media and, for die-cut
+ * labels, have their length, so that the filter does not stop the job for
+ * the wrong media. A length given with -l is kept.
+ *
+ * @param options the benchmark, `width` and `lines` are set
+ */
+static void
+size_pages(settings *options)
+{
+	ql_trace trace;
+	const ql_media *media = NULL;
+
+	if (ql_trace_load(&trace, options->trace)) {
+		for (size_t i = 0; i < trace.count; i++) {
+			ql_status status;
+
+			if (trace.entries[i].length != (int)sizeof(status))
+				continue;
+
+			memcpy(&status, trace.entries[i].data, sizeof(status));
+			media = ql_media_lookup(status.media_width, status.media_length);
+			break;
+		}
+
+		ql_trace_close(&trace);
+	}
+
+	options->width = media != NULL ? media->printable : DEFAULT_WIDTH;
+
+	if (options->lines == 0)
+		options->lines = media != NULL && media->length != 0
+				? media->length * 300 / 25.4 + 0.5
+				: DEFAULT_LINES;
+
+	if (options->verbose)
+		fprintf(stderr, "Pages are %ux%u dots%s.\n", options->width,
+				options->lines, media != NULL ? "" : ", the media is unknown");
+}
+
+/**
+ * Write the pages of a job.
+ *
+ * Pages have a black frame, stripes and some noise, so that the encoder has
+ * something to do. The content is the same for every run.
+ *
+ * @param fd where to write the raster stream
+ * @param options size and number of pages
+ */
+static void
+write_job(int fd, const settings *options)
+{
+	cups_raster_t *raster = cupsRasterOpen(fd, CUPS_RASTER_WRITE);
+	cups_page_header2_t header;
+	unsigned int bytes = (options->width + 7) / 8;
+	uint8_t line[bytes];
+	uint32_t noise = 0x12345678;
+
+	memset(&header, 0x00, sizeof(header));
+	header.cupsWidth = options->width;
+	header.cupsHeight = options->lines;
+	header.cupsBitsPerColor = 1;
+	header.cupsBitsPerPixel = 1;
+	header.cupsBytesPerLine = bytes;
+	header.cupsColorOrder = CUPS_ORDER_CHUNKED;
+	header.cupsColorSpace = CUPS_CSPACE_K;
+	header.HWResolution[0] = 300;
+	header.HWResolution[1] = 300;
+	header.PageSize[0] = options->width * 72 / 300;
+	header.PageSize[1] = options->lines * 72 / 300;
+	header.NumCopies = 1;
+
+	for (unsigned int page = 0; page < options->pages; page++) {
+		if (!cupsRasterWriteHeader2(raster, &header))
+			break;
+
+		for (unsigned int y = 0; y < options->lines; y++) {
+			bool frame = y < 8 || y >= options->lines - 8;
+
+			for (unsigned int x = 0; x < bytes; x++) {
+				// xorshift32
+				noise ^= noise << 13;
+				noise ^= noise >> 17;
+				noise ^= noise << 5;
+
+				if (frame || x == 0 || x == bytes - 1)
+					line[x] = 0xFF;
+				else if ((y / 16) % 4 == 0)
+					line[x] = 0xF0;
+				else
+					line[x] = noise & (noise >> 8);
+			}
+
+			if (cupsRasterWritePixels(raster, line, bytes) != bytes)
+				break;
+		}
+	}
+
+	cupsRasterClose(raster);
+}
+
+/**
+ * Run the filter once.
+ *
+ * @param options the benchmark
+ * @returns time the job took in seconds, or a negative number if the filter
+ *          failed
+ */
+static double
+run(const settings *options)
+{
+	int input[2];
+
+	if (pipe(input) != 0)
+		return -1;
+
+	double start = now();
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		close(input[0]);
+		close(input[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+
+		dup2(input[0], STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+
+		if (!options->verbose)
+			dup2(null, STDERR_FILENO);
+
+		close(input[0]);
+		close(input[1]);
+		close(null);
+
+		// Counters of the printer are not touched by benchmarks.
+		setenv("QL_TRACE_REPLAY", options->trace, 1);
+		setenv("QL_STATE_DIR", "", 1);
+		unsetenv("QL_TEXTFILE_DIR");
+		unsetenv("QL_TRACE_RECORD");
+
+		execl(options->filter, options->filter, "1", "bench", "bench", "1",
+				options->options, (char *)NULL);
+		_exit(127);
+	}
+
+	close(input[0]);
+	write_job(input[1], options);
+	close(input[1]);
+
+	int status;
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+
+	return now() - start;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Measure how long the filter takes for a job, with the printer replaced by
+ * a recorded status trace.
+ *
+ * The exit status is non-zero if the filter failed or the job took longer
+ * than allowed, so this can run as part of a build.
+ *
+ * Usage: ql570bench [options] filter trace
+ */
+int main(int argc, char **argv)
+{
+	settings options = {
+		.options = "",
+		.runs = 5,
+		.pages = 3
+	};
+	const char *baseline = NULL;
+	double limit = 0;
+	double tolerance = 10;
+	bool store = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:p:l:o:t:b:x:wvh")) != -1) {
+		switch (opt) {
+		case 'n': options.runs = atoi(optarg); break;
+		case 'p': options.pages = atoi(optarg); break;
+		case 'l': options.lines = atoi(optarg); break;
+		case 'o': options.options = optarg; break;
+		case 't': limit = atof(optarg); break;
+		case 'b': baseline = optarg; break;
+		case 'x': tolerance = atof(optarg); break;
+		case 'w': store = true; break;
+		case 'v': options.verbose = true; break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 2 || options.runs == 0 || options.runs > MAX_RUNS
+	    || options.pages == 0 || (store && baseline == NULL)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	options.filter = argv[optind];
+	options.trace = argv[optind + 1];
+	size_pages(&options);
+
+	// The filter may stop reading early.
+	signal(SIGPIPE, SIG_IGN);
+
+	double times[MAX_RUNS];
+
+	for (unsigned int i = 0; i < options.runs; i++) {
+		times[i] = run(&options);
+
+		if (times[i] < 0) {
+			fprintf(stderr, "Error: the filter failed, run with -v for details.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	qsort(times, options.runs, sizeof(double), compare);
+
+	double median = times[options.runs / 2];
+
+	printf("%.3f s median, %.3f s to %.3f s over %u runs\n", median, times[0],
+			times[options.runs - 1], options.runs);
+
+	if (baseline != NULL && store) {
+		FILE *file = fopen(baseline, "w");
+
+		if (file == NULL || fprintf(file, "%.6f\n", median) < 0 || fclose(file) != 0) {
+			fprintf(stderr, "Error: could not write %s.\n", baseline);
+			return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	if (baseline != NULL) {
+		FILE *file = fopen(baseline, "r");
+		double stored;
+
+		if (file == NULL || fscanf(file, "%lf", &stored) != 1) {
+			fprintf(stderr, "Error: could not read %s.\n", baseline);
+
+			if (file != NULL)
+				fclose(file);
+
+			return EXIT_FAILURE;
+		}
+
+		fclose(file);
+
+		double allowed = stored * (1 + tolerance / 100);
+
+		if (limit == 0 || allowed < limit)
+			limit = allowed;
+	}
+
+	if (limit > 0 && median > limit) {
+		fprintf(stderr, "Error: %.3f s is more than the %.3f s allowed.\n", median, limit);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
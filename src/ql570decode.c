@@ -0,0 +1,541 @@
+/* ql570decode.c: check and render captured printer command streams
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ql570.h"
+
+/**
+ * Number of problems reported in detail, unless -v is given.
+ */
+#define MAX_REPORTED 50
+
+/**
+ * Largest raster line the decoder handles, in bytes.
+ */
+#define MAX_LINE 256
+
+typedef struct decoder decoder;
+struct decoder {
+	/**
+	 * Write pages as `<prefix>-<n>.pbm`, or NULL.
+	 */
+	const char *prefix;
+	bool verbose;
+
+	/**
+	 * Length of raster lines after decompression, zero until known.
+	 */
+	unsigned int line_length;
+
+	/**
+	 * Offset of the command being decoded, for messages.
+	 */
+	size_t offset;
+
+	unsigned int page;
+	bool have_info;
+	ql_print_info info;
+	uint32_t lines;
+	bool compressed;
+
+	/**
+	 * Set by ESC i K, the page has 600 lines per inch. Its dots are
+	 * written twice across, so that the PBM has the right proportions.
+	 */
+	bool high_resolution;
+	bool job_ended;
+
+	/**
+	 * The current page as PBM lines, if pages are written.
+	 */
+	FILE *render;
+	char *render_data;
+	size_t render_size;
+
+	unsigned long errors;
+	unsigned long warnings;
+	uint64_t total_lines;
+};
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] file...\n"
+		"\n"
+		"Decodes and checks command streams as sent to a printer of the QL\n"
+		"series, e.g. captured with the `file:` CUPS backend.\n"
+		"\n"
+		"  -o prefix     write each page to <prefix>-<n>.pbm\n"
+		"  -b bytes      length of a raster line, for compressed streams\n"
+		"                (default: from the stream, or 90)\n"
+		"  -v            report every problem, not just the first %d\n",
+		name, MAX_REPORTED);
+}
+
+/**
+ * Report a problem with the stream.
+ *
+ * @param dec the decoder
+ * @param error true for errors (the printer would reject the data or print
+ *        something else), false for warnings
+ * @param format printf() format of the message
+ */
+static void
+problem(decoder *dec, bool error, const char *format, ...)
+{
+	unsigned long count = error ? ++dec->errors : ++dec->warnings;
+
+	if (!dec->verbose && count > MAX_REPORTED)
+		return;
+
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "%s at offset %zu (page %u): ", error ? "Error" : "Warning",
+			dec->offset, dec->page + 1);
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+/**
+ * Decompress a PackBits (TIFF) encoded raster line.
+ *
+ * @param src compressed data
+ * @param len length of the compressed data
+ * @param dst decompressed line
+ * @param dst_len expected length of the line
+ * @returns number of bytes decompressed, or -1 if the data is malformed
+ */
+static int
+packbits(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_len)
+{
+	size_t out = 0;
+
+	for (size_t i = 0; i < len; ) {
+		int8_t n = src[i++];
+
+		if (n >= 0) {
+			if (i + n + 1 > len || out + n + 1 > dst_len)
+				return -1;
+
+			memcpy(dst + out, src + i, n + 1);
+			i += n + 1;
+			out += n + 1;
+		} else if (n != -128) {
+			if (i >= len || out + 1 - n > dst_len)
+				return -1;
+
+			memset(dst + out, src[i++], 1 - n);
+			out += 1 - n;
+		}
+	}
+
+	return out;
+}
+
+/**
+ * Add a raster line to the current page.
+ */
+static void
+add_line(decoder *dec, const uint8_t *data, size_t length)
+{
+	if (!dec->have_info && dec->lines == 0)
+		problem(dec, true, "raster data before print information (ESC i z)");
+
+	if (dec->line_length == 0)
+		dec->line_length = length;
+
+	if (length != dec->line_length)
+		problem(dec, true, "raster line of %zu bytes, expected %u", length,
+				dec->line_length);
+
+	dec->lines++;
+
+	if (dec->prefix == NULL)
+		return;
+
+	if (dec->render == NULL)
+		dec->render = open_memstream(&dec->render_data, &dec->render_size);
+
+	if (dec->render != NULL) {
+		uint8_t line[MAX_LINE] = { 0 };
+		memcpy(line, data, length < dec->line_length ? length : dec->line_length);
+		fwrite(line, 1, dec->line_length, dec->render);
+	}
+}
+
+/**
+ * Check and write out the page that just ended.
+ */
+static void
+end_page(decoder *dec, bool last)
+{
+	uint32_t expected = dec->info.raster_number[0]
+		| dec->info.raster_number[1] << 8
+		| dec->info.raster_number[2] << 16
+		| (uint32_t)dec->info.raster_number[3] << 24;
+
+	const ql_model *model = ql_model_lookup(dec->line_length == 162 ? QL_1060N : QL_570);
+
+	if (dec->lines == 0)
+		problem(dec, true, "page without raster lines");
+	else if (dec->have_info && expected != dec->lines)
+		problem(dec, true, "page has %u raster lines, print information announced %u",
+				dec->lines, expected);
+
+	if (dec->lines > 0 && dec->lines < model->min_lines)
+		problem(dec, true, "page has %u raster lines, the printer needs at least %u",
+				dec->lines, model->min_lines);
+
+	if (dec->render != NULL) {
+		char name[4096];
+		snprintf(name, sizeof(name), "%s-%u.pbm", dec->prefix, dec->page + 1);
+		fclose(dec->render);
+
+		FILE *out = fopen(name, "wb");
+
+		if (out == NULL) {
+			fprintf(stderr, "Error while writing %s: %s\n", name, strerror(errno));
+		} else {
+			unsigned int across = dec->high_resolution ? 2 : 1;
+
+			fprintf(out, "P4\n%u %u\n", dec->line_length * 8 * across, dec->lines);
+
+			if (!dec->high_resolution) {
+				fwrite(dec->render_data, 1, dec->render_size, out);
+			} else {
+				for (size_t j = 0; j < dec->render_size; j++) {
+					uint8_t byte = dec->render_data[j];
+					uint8_t wide[2] = { 0 };
+
+					for (int bit = 0; bit < 8; bit++) {
+						if (byte & (0x80 >> bit))
+							wide[bit / 4] |= 0xC0 >> (2 * (bit % 4));
+					}
+
+					fwrite(wide, 1, 2, out);
+				}
+			}
+
+			fclose(out);
+		}
+
+		free(dec->render_data);
+		dec->render = NULL;
+		dec->render_data = NULL;
+	}
+
+	dec->total_lines += dec->lines;
+	dec->page++;
+	dec->lines = 0;
+	dec->have_info = false;
+	dec->job_ended = last;
+}
+
+/**
+ * Forget a page that was cut short, without writing it out.
+ */
+static void
+discard_page(decoder *dec)
+{
+	if (dec->render != NULL) {
+		fclose(dec->render);
+		free(dec->render_data);
+		dec->render = NULL;
+		dec->render_data = NULL;
+	}
+
+	dec->lines = 0;
+	dec->have_info = false;
+	dec->compressed = false;
+	dec->high_resolution = false;
+}
+
+/**
+ * Decode a command stream.
+ *
+ * @param dec the decoder
+ * @param p the stream
+ * @param len length of the stream
+ */
+static void
+decode(decoder *dec, const uint8_t *p, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		size_t left = len - i;
+		uint8_t c = p[i];
+
+		dec->offset = i;
+
+		if (dec->job_ended && c != 0x00 && c != QL_ESC) {
+			problem(dec, false, "data after the end of the job");
+			dec->job_ended = false;
+		}
+
+		switch (c) {
+		case 0x00:
+			// Filler, e.g. to flush the printer.
+			i++;
+			continue;
+
+		case 0x0C:
+		case 0x1A:
+			end_page(dec, c == 0x1A);
+			i++;
+			continue;
+
+		case 'M':
+			if (left < 2)
+				break;
+
+			if (p[i + 1] != 0x00 && p[i + 1] != 0x02)
+				problem(dec, true, "unknown compression mode 0x%02x", p[i + 1]);
+
+			dec->compressed = p[i + 1] == 0x02;
+			i += 2;
+			continue;
+
+		case 'Z':
+			{
+				uint8_t zero[MAX_LINE] = { 0 };
+				add_line(dec, zero, dec->line_length ? dec->line_length : 90);
+			}
+			i++;
+			continue;
+
+		case 'g':
+		case 'G':
+			{
+				if (left < 3)
+					break;
+
+				size_t n = c == 'g' ? p[i + 2] : (size_t)(p[i + 1] | p[i + 2] << 8);
+
+				if (left - 3 < n)
+					break;
+
+				const uint8_t *data = p + i + 3;
+
+				if (c == 'g' && p[i + 1] == 0xFF) {
+					// End of raster data, as sent by rastertoql570.
+					if (dec->line_length != 0 && n != dec->line_length)
+						problem(dec, false, "raster end of %zu bytes, lines have %u",
+								n, dec->line_length);
+				} else if (c == 'g' && p[i + 1] != 0x00) {
+					problem(dec, true, "malformed raster command g 0x%02x", p[i + 1]);
+				} else if (dec->compressed) {
+					uint8_t line[MAX_LINE];
+					unsigned int expected = dec->line_length ? dec->line_length : 90;
+					int decoded = packbits(data, n, line, expected);
+
+					if (decoded < 0)
+						problem(dec, true, "malformed compressed raster line");
+					else
+						add_line(dec, line, decoded);
+				} else if (n > MAX_LINE) {
+					problem(dec, true, "raster line of %zu bytes is too long", n);
+				} else {
+					add_line(dec, data, n);
+				}
+
+				i += 3 + n;
+				continue;
+			}
+
+		case QL_ESC:
+			if (left < 2)
+				break;
+
+			if (p[i + 1] == '@') {
+				if (dec->lines > 0)
+					problem(dec, true, "initialisation in the middle of a page");
+
+				discard_page(dec);
+				dec->job_ended = false;
+				i += 2;
+				continue;
+			}
+
+			if (p[i + 1] != 'i' || left < 3) {
+				if (p[i + 1] != 'i')
+					problem(dec, true, "unknown command ESC 0x%02x", p[i + 1]);
+				else
+					break;
+
+				i++;
+				continue;
+			}
+
+			{
+				size_t size;
+
+				switch (p[i + 2]) {
+				case 'S': size = 3; break;
+				case 'z': size = 3 + sizeof(ql_print_info); break;
+				case 'K': size = 4; break;
+				case 'M': size = 4; break;
+				case 'A': size = 4; break;
+				case 'a': size = 4; break;
+				case 'd': size = 5; break;
+				default:
+					// The length of the command is not known, so
+					// only its header is skipped.
+					problem(dec, true, "unknown command ESC i 0x%02x", p[i + 2]);
+					i += 3;
+					continue;
+				}
+
+				if (left < size)
+					break;
+
+				if (p[i + 2] == 'z') {
+					if (dec->lines > 0)
+						problem(dec, true, "print information in the middle of a page");
+
+					memcpy(&dec->info, p + i + 3, sizeof(ql_print_info));
+					dec->have_info = true;
+				} else if (p[i + 2] == 'K') {
+					dec->high_resolution = p[i + 3] & OPT_HIGH_RESOLUTION;
+				}
+
+				i += size;
+				continue;
+			}
+
+		default:
+			problem(dec, true, "unknown byte 0x%02x", c);
+			i++;
+			continue;
+		}
+
+		// Only truncated commands end up here.
+		problem(dec, true, "stream ends within a command");
+		break;
+	}
+
+	dec->offset = len;
+
+	if (dec->lines > 0)
+		problem(dec, true, "stream ends within a page");
+	else if (dec->page > 0 && !dec->job_ended)
+		problem(dec, false, "last page does not end the job (0x1A)");
+}
+
+/**
+ * Decode and check command streams as sent to the printer.
+ *
+ * Each file is mapped into memory and decoded in one pass. Problems are
+ * reported on stderr, a summary (with the throughput of the decoder) on
+ * stdout. The exit status is non-zero if there were errors.
+ *
+ * Usage: ql570decode [options] file...
+ */
+int main(int argc, char **argv)
+{
+	decoder dec = { 0 };
+	unsigned int line_length = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:b:vh")) != -1) {
+		switch (opt) {
+		case 'o': dec.prefix = optarg; break;
+		case 'b': line_length = strtoul(optarg, NULL, 10); break;
+		case 'v': dec.verbose = true; break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || line_length > MAX_LINE) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	uint64_t bytes = 0;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int f = optind; f < argc; f++) {
+		int fd = open(argv[f], O_RDONLY);
+		struct stat st;
+
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			fprintf(stderr, "Error while reading %s: %s\n", argv[f], strerror(errno));
+			dec.errors++;
+
+			if (fd >= 0)
+				close(fd);
+
+			continue;
+		}
+
+		if (st.st_size == 0) {
+			close(fd);
+			continue;
+		}
+
+		const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "Error while reading %s: %s\n", argv[f], strerror(errno));
+			dec.errors++;
+			continue;
+		}
+
+		madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+		// Each file is a job of its own, a page left unfinished by the
+		// previous file has been reported already.
+		discard_page(&dec);
+		dec.line_length = line_length;
+		dec.job_ended = false;
+		decode(&dec, map, st.st_size);
+		bytes += st.st_size;
+
+		munmap((void *)map, st.st_size);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%u pages, %llu raster lines, %llu bytes in %.3f s (%.1f MB/s)\n",
+			dec.page, (unsigned long long)dec.total_lines,
+			(unsigned long long)bytes, seconds,
+			seconds > 0 ? bytes / seconds / 1e6 : 0);
+	printf("%lu errors, %lu warnings\n", dec.errors, dec.warnings);
+
+	return dec.errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,514 @@
+/* ql570print.c: print PBM and XBM images without CUPS
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ql570.h"
+#include "transform.h"
+
+/**
+ * An image to be printed as one label.
+ */
+typedef struct image image;
+struct image {
+	uint32_t width;
+	uint32_t height;
+	size_t stride;
+
+	/**
+	 * Lines of 1 bit per dot, most significant bit first, black is 1.
+	 * Points into the mapped file for PBM, is allocated for XBM.
+	 */
+	const uint8_t *data;
+	uint8_t *allocated;
+};
+
+/**
+ * Settings from the command line.
+ */
+typedef struct settings settings;
+struct settings {
+	bool mirror;
+	bool high_resolution;
+	uint32_t padding;
+
+	/**
+	 * Cut after every n labels, zero to cut at the end of the job only.
+	 */
+	unsigned int cut;
+};
+
+/**
+ * Bits of a byte in reverse order.
+ */
+static uint8_t reversed[256];
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] file...\n"
+		"\n"
+		"Prints PBM (P4) and XBM images, one label per image, as one job.\n"
+		"\n"
+		"  -d device     printer device (default /dev/usb/lp0)\n"
+		"  -n host[:port] printer on the network (port 9100 by default)\n"
+		"  -m            mirror the images\n"
+		"  -p lines      blank lines before and after each image\n"
+		"  -c n          cut after every n labels, 0 cuts at the end only\n"
+		"                (default 1)\n"
+		"  -6            images are 300x600 dpi\n",
+		name);
+}
+
+/**
+ * Skip whitespace and comments in a PBM header.
+ */
+static const char *
+pbm_skip(const char *p, const char *end)
+{
+	while (p < end) {
+		if (*p == '#') {
+			while (p < end && *p != '\n')
+				p++;
+		} else if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			p++;
+		} else {
+			break;
+		}
+	}
+
+	return p;
+}
+
+/**
+ * Read a number from a PBM header.
+ */
+static const char *
+pbm_number(const char *p, const char *end, uint32_t *value)
+{
+	p = pbm_skip(p, end);
+	*value = 0;
+
+	if (p >= end || *p < '0' || *p > '9')
+		return NULL;
+
+	while (p < end && *p >= '0' && *p <= '9')
+		*value = *value * 10 + (*p++ - '0');
+
+	return p;
+}
+
+/**
+ * Read the next image of a PBM file.
+ *
+ * A file may hold several images one after the other. The image data is not
+ * copied.
+ *
+ * @param p start of the image in the mapped file
+ * @param end end of the mapped file
+ * @param img image to fill
+ * @returns the start of the next image, or NULL if the data is not a valid
+ *          raw PBM image
+ */
+static const char *
+pbm_read(const char *p, const char *end, image *img)
+{
+	if (end - p < 2 || p[0] != 'P' || p[1] != '4')
+		return NULL;
+
+	p = pbm_number(p + 2, end, &img->width);
+
+	if (p != NULL)
+		p = pbm_number(p, end, &img->height);
+
+	// A single whitespace character separates header and data.
+	if (p == NULL || p >= end || img->width == 0)
+		return NULL;
+
+	p++;
+	img->stride = (img->width + 7) / 8;
+	img->data = (const uint8_t *)p;
+	img->allocated = NULL;
+
+	if ((size_t)(end - p) / img->stride < img->height)
+		return NULL;
+
+	return p + img->stride * img->height;
+}
+
+/**
+ * Read an XBM file.
+ *
+ * XBM files are C source code. The width, height and the bytes of the image
+ * are picked out of it, without a closer look at the rest. XBM stores the
+ * leftmost dot in the least significant bit, the bits are reversed here.
+ *
+ * @param p start of the mapped file
+ * @param end end of the mapped file
+ * @param img image to fill, the data is allocated
+ * @returns false if the file does not look like an XBM image
+ */
+static bool
+xbm_read(const char *p, const char *end, image *img)
+{
+	char text[4096];
+	size_t length = end - p < (ptrdiff_t)sizeof(text) - 1 ? (size_t)(end - p) : sizeof(text) - 1;
+	const char *width, *height, *bits;
+
+	memcpy(text, p, length);
+	text[length] = '\0';
+
+	width = strstr(text, "_width ");
+	height = strstr(text, "_height ");
+	bits = memchr(p, '{', end - p);
+
+	if (width == NULL || height == NULL || bits == NULL)
+		return false;
+
+	img->width = strtoul(width + 7, NULL, 10);
+	img->height = strtoul(height + 8, NULL, 10);
+	img->stride = (img->width + 7) / 8;
+
+	if (img->width == 0 || img->height == 0)
+		return false;
+
+	img->allocated = calloc(img->height, img->stride);
+
+	if (img->allocated == NULL)
+		return false;
+
+	img->data = img->allocated;
+	bits++;
+
+	for (size_t i = 0; i < img->height * img->stride; i++) {
+		char *next;
+
+		while (bits < end && (*bits == ' ' || *bits == '\n' || *bits == '\r'
+				|| *bits == '\t' || *bits == ','))
+			bits++;
+
+		if (bits >= end || *bits == '}')
+			break;
+
+		// Hexadecimal numbers end before the next comma, the mapping
+		// may not end in a terminating null byte, so copy.
+		char number[8] = { 0 };
+		memcpy(number, bits, end - bits < 7 ? end - bits : 7);
+		img->allocated[i] = reversed[strtoul(number, &next, 0) & 0xFF];
+
+		if (next == number)
+			break;
+
+		bits += next - number;
+	}
+
+	return true;
+}
+
+/**
+ * Encode an image as a page.
+ *
+ * @param img the image
+ * @param model printer model
+ * @param media loaded media, or NULL
+ * @param options settings from the command line
+ * @param page_number index of the page in the job
+ * @param out stream to write to
+ */
+static void
+print_image(const image *img, const ql_model *model, const ql_media *media,
+		const settings *options, unsigned int page_number, FILE *out)
+{
+	size_t head_bytes = model->bytes_per_line;
+	uint32_t lines = img->height + 2 * options->padding;
+	uint32_t blanks = lines < model->min_lines ? model->min_lines - lines : 0;
+	uint32_t total = lines + blanks;
+	uint8_t line[head_bytes];
+	uint8_t mirrored[img->stride + 1];
+	ql_placement placement;
+
+	ql_print_info print_info = {
+		.valid_flag = PIV_QUALITY,
+		.raster_number[0] = total & 0xFF,
+		.raster_number[1] = (total >> 8) & 0xFF,
+		.raster_number[2] = (total >> 16) & 0xFF,
+		.successive_page = page_number > 0
+	};
+
+	ql_placement_init(&placement, model, media, img->width);
+
+	// Mirrored lines are reversed byte by byte, which moves the padding
+	// bits of the last byte to the front.
+	if (options->mirror)
+		placement.src_bit += img->stride * 8 - img->width;
+
+	ql_page_start(&print_info, out);
+
+	if (options->cut > 0) {
+		ql_autocut_enable(out);
+		ql_autocut_interval(options->cut, out);
+	} else {
+		ql_autocut_disable(out);
+	}
+
+	ql_set_extended_options(true, options->high_resolution, out);
+
+	memset(line, 0x00, head_bytes);
+
+	for (uint32_t i = 0; i < blanks / 2 + options->padding; i++)
+		ql_raster(head_bytes, line, out);
+
+	for (uint32_t y = 0; y < img->height; y++) {
+		const uint8_t *src = img->data + y * img->stride;
+
+		if (options->mirror) {
+			for (size_t i = 0; i < img->stride; i++)
+				mirrored[i] = reversed[src[img->stride - 1 - i]];
+
+			src = mirrored;
+		}
+
+		ql_place(&placement, line, head_bytes, src, img->stride);
+		ql_raster(head_bytes, line, out);
+	}
+
+	memset(line, 0x00, head_bytes);
+
+	for (uint32_t i = 0; i < blanks - blanks / 2 + options->padding; i++)
+		ql_raster(head_bytes, line, out);
+
+	ql_raster_end(head_bytes, out);
+}
+
+/**
+ * Send an image to the printer as the next page of the job.
+ *
+ * The page is encoded into memory and written at once.
+ *
+ * @param img the image, allocated data is released
+ * @param model printer model
+ * @param media loaded media, or NULL
+ * @param options settings from the command line
+ * @param pages number of pages sent so far, updated
+ * @param printer stream to the printer
+ * @returns 1 if the page was sent, 0 if out of memory
+ */
+static unsigned int
+send_image(image *img, const ql_model *model, const ql_media *media,
+		const settings *options, unsigned int *pages, FILE *printer)
+{
+	char *buffer = NULL;
+	size_t size = 0;
+	FILE *page = open_memstream(&buffer, &size);
+
+	if (page == NULL) {
+		fprintf(stderr, "Error: out of memory.\n");
+		free(img->allocated);
+		return 0;
+	}
+
+	// The end of the previous page tells whether another page follows,
+	// so it is only written now.
+	if (*pages > 0)
+		ql_page_end(false, printer);
+
+	print_image(img, model, media, options, (*pages)++, page);
+	fclose(page);
+
+	fwrite(buffer, 1, size, printer);
+	free(buffer);
+	free(img->allocated);
+
+	return 1;
+}
+
+/**
+ * Connect to the printer given on the command line.
+ */
+static FILE *
+open_printer(const char *device, const char *host)
+{
+	if (host == NULL)
+		return fopen(device, "r+b");
+
+	char name[256];
+	const char *port = "9100";
+
+	snprintf(name, sizeof(name), "%s", host);
+
+	char *colon = strrchr(name, ':');
+
+	if (colon != NULL) {
+		*colon = '\0';
+		port = colon + 1;
+	}
+
+	return ql_net_open(name, port, 10000);
+}
+
+/**
+ * Print PBM and XBM images as one job.
+ *
+ * All files are mapped into memory and every image becomes a label. Each
+ * label is encoded into memory and written to the printer at once; the
+ * raster lines are moved into place for the loaded media straight from the
+ * mapped file.
+ *
+ * Usage: ql570print [options] file...
+ */
+int main(int argc, char **argv)
+{
+	const char *device = "/dev/usb/lp0";
+	const char *host = NULL;
+	settings options = { .cut = 1 };
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n:mp:c:6h")) != -1) {
+		switch (opt) {
+		case 'd': device = optarg; break;
+		case 'n': host = optarg; break;
+		case 'm': options.mirror = true; break;
+		case 'p': options.padding = strtoul(optarg, NULL, 10); break;
+		case 'c': options.cut = strtoul(optarg, NULL, 10); break;
+		case '6': options.high_resolution = true; break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || options.cut > 255) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned int i = 0; i < 256; i++) {
+		for (unsigned int j = 0; j < 8; j++) {
+			if (i & (1 << j))
+				reversed[i] |= 0x80 >> j;
+		}
+	}
+
+	FILE *printer = open_printer(device, host);
+
+	if (printer == NULL) {
+		fprintf(stderr, "Error while opening %s: %s\n",
+				host != NULL ? host : device, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	ql_status status = {0};
+	const ql_model *model = ql_model_lookup(QL_570);
+	const ql_media *media = NULL;
+	bool have_status;
+
+	ql_init(false, printer);
+	ql_status_request(printer);
+	have_status = ql_status_read(&status, printer) && status.print_head_mark == 0x80;
+
+	if (have_status) {
+		model = ql_model_lookup(status.printer_id);
+		media = ql_media_lookup(status.media_width, status.media_length);
+	} else {
+		fprintf(stderr, "Warning: no status from the printer, assuming a %s.\n",
+				model->name);
+	}
+
+	unsigned int pages = 0;
+	int result = EXIT_SUCCESS;
+
+	for (int f = optind; f < argc; f++) {
+		int fd = open(argv[f], O_RDONLY);
+		struct stat st;
+
+		if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+			fprintf(stderr, "Error while reading %s: %s\n", argv[f],
+					fd < 0 ? strerror(errno) : "empty file");
+			result = EXIT_FAILURE;
+
+			if (fd >= 0)
+				close(fd);
+
+			continue;
+		}
+
+		const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "Error while reading %s: %s\n", argv[f], strerror(errno));
+			result = EXIT_FAILURE;
+			continue;
+		}
+
+		madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+		const char *end = map + st.st_size;
+		const char *p = map;
+		unsigned int images = 0;
+		image img;
+
+		if (map[0] == 'P') {
+			// PBM files may hold several images.
+			while (p < end && (p = pbm_read(p, end, &img)) != NULL) {
+				images += send_image(&img, model, media, &options, &pages, printer);
+				p = pbm_skip(p, end);
+			}
+		} else if (xbm_read(map, end, &img)) {
+			images += send_image(&img, model, media, &options, &pages, printer);
+		}
+
+		if (images == 0) {
+			fprintf(stderr, "Error: %s is neither a PBM (P4) nor an XBM image.\n", argv[f]);
+			result = EXIT_FAILURE;
+		}
+
+		munmap((void *)map, st.st_size);
+	}
+
+	if (pages > 0)
+		ql_page_end(true, printer);
+
+	// Follow the printer until it is done with the job.
+	for (unsigned int completed = 0; have_status && completed < pages
+			&& ql_status_read(&status, printer); ) {
+		if (status.status_type == ST_ERROR) {
+			fprintf(stderr, "Error: the printer stopped with error %02x %02x.\n",
+					status.error_info_1, status.error_info_2);
+			result = EXIT_FAILURE;
+			break;
+		}
+
+		if (status.status_type == ST_COMPLETED)
+			completed++;
+	}
+
+	fclose(printer);
+
+	return result;
+}
@@ -0,0 +1,346 @@
+/* ql570standin.c: a stand-in for a networked printer, for testing
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "ql570.h"
+
+/**
+ * Largest command kept while waiting for the rest of it: a raster line.
+ */
+#define MAX_COMMAND (3 + UINT16_MAX)
+
+typedef struct printer printer;
+struct printer {
+	/**
+	 * What the status says is loaded.
+	 */
+	uint8_t printer_id;
+	uint8_t media_width;
+	uint8_t media_length;
+
+	/**
+	 * Where everything received goes, or NULL.
+	 */
+	FILE *record;
+	bool verbose;
+
+	unsigned long pages;
+	unsigned long status_requests;
+};
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [command...]\n"
+		"\n"
+		"Listens like a networked printer, answers status requests and\n"
+		"reports each page as printed. With a command, the command is run\n"
+		"once we listen, and we exit with its exit status when it is done.\n"
+		"\n"
+		"  -p port       port to listen on (default: 9100)\n"
+		"  -o file       write everything received to the file\n"
+		"  -i id         printer id in the status (default: 0x33, QL-580N)\n"
+		"  -w mm         width of the loaded media (default: 62)\n"
+		"  -l mm         length of die-cut labels, 0 for continuous tape\n"
+		"  -v            show the commands received\n",
+		name);
+}
+
+/**
+ * Send a status to the client.
+ */
+static bool
+send_status(int fd, const printer *p, uint8_t type, uint8_t phase)
+{
+	ql_status status;
+
+	memset(&status, 0x00, sizeof(status));
+	status.print_head_mark = 0x80;
+	status.size = sizeof(status);
+	status.printer_id = p->printer_id;
+	status.media_width = p->media_width;
+	status.media_length = p->media_length;
+	status.media_type = p->media_length > 0 ? MT_DIE_CUT : MT_CONTINUOUS;
+	status.status_type = type;
+	status.phase_type = phase;
+
+	return send(fd, &status, sizeof(status), MSG_NOSIGNAL) == sizeof(status);
+}
+
+/**
+ * Length of the command at the start of `data`.
+ *
+ * @return length of the command, 0 if more data is needed to tell
+ */
+static size_t
+command_length(const uint8_t *data, size_t length)
+{
+	switch (data[0]) {
+	case QL_ESC:
+		if (length < 3)
+			return length < 2 || data[1] != '@' ? 0 : 2;
+
+		if (data[1] != 'i')
+			return data[1] == '@' ? 2 : 1;
+
+		switch (data[2]) {
+		case 'S': return 3;
+		case 'z': return 13;
+		case 'd': return 5;
+		default: return 4;
+		}
+
+	case 'g':
+		return length < 3 ? 0 : 3 + data[2];
+
+	case 'G':
+		return length < 3 ? 0 : 3 + (data[1] | data[2] << 8);
+
+	case 'M':
+		return 2;
+
+	default:
+		return 1;
+	}
+}
+
+/**
+ * Talk to one client until it disconnects.
+ */
+static void
+serve(int fd, printer *p)
+{
+	static uint8_t buffer[2 * MAX_COMMAND];
+	size_t length = 0;
+
+	while (true) {
+		ssize_t received = recv(fd, buffer + length, sizeof(buffer) - length, 0);
+
+		if (received < 0 && errno == EINTR)
+			continue;
+
+		if (received <= 0)
+			break;
+
+		if (p->record != NULL)
+			fwrite(buffer + length, 1, received, p->record);
+
+		length += received;
+
+		size_t i = 0;
+
+		while (i < length) {
+			size_t command = command_length(buffer + i, length - i);
+
+			if (command == 0 || command > length - i)
+				break;
+
+			const uint8_t *c = buffer + i;
+
+			if (c[0] == QL_ESC && c[1] == 'i' && c[2] == 'S') {
+				p->status_requests++;
+				send_status(fd, p, ST_REPLY, PT_WAITING);
+			} else if (c[0] == 0x0C || c[0] == 0x1A) {
+				p->pages++;
+
+				if (p->verbose)
+					fprintf(stderr, "Page %lu printed.\n", p->pages);
+
+				send_status(fd, p, ST_PHASE_CHANGE, PT_PRINTING);
+				send_status(fd, p, ST_COMPLETED, PT_PRINTING);
+				send_status(fd, p, ST_PHASE_CHANGE, PT_WAITING);
+			} else if (p->verbose && c[0] != 0x00 && c[0] != 'g' && c[0] != 'G') {
+				fprintf(stderr, "Command 0x%02x", c[0]);
+
+				for (size_t j = 1; j < command && j < 13; j++)
+					fprintf(stderr, " 0x%02x", c[j]);
+
+				fputc('\n', stderr);
+			}
+
+			i += command;
+		}
+
+		memmove(buffer, buffer + i, length - i);
+		length -= i;
+	}
+
+	if (p->record != NULL)
+		fflush(p->record);
+}
+
+/**
+ * Listen on a port, on all addresses.
+ *
+ * @return the socket, or -1 on error
+ */
+static int
+listen_on(const char *port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET6,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE
+	};
+	struct addrinfo *result;
+	int fd = -1;
+
+	if (getaddrinfo(NULL, port, &hints, &result) != 0) {
+		hints.ai_family = AF_INET;
+
+		if (getaddrinfo(NULL, port, &hints, &result) != 0)
+			return -1;
+	}
+
+	for (struct addrinfo *ai = result; ai != NULL && fd < 0; ai = ai->ai_next) {
+		int one = 1;
+		int zero = 0;
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+		if (fd < 0)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		// Accept IPv4 clients as well.
+		if (ai->ai_family == AF_INET6)
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 4) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(result);
+
+	return fd;
+}
+
+/**
+ * A stand-in for a networked printer in the QL series.
+ *
+ * Commands are taken apart just enough to answer status requests (ESC i S)
+ * and to report every page as printed once it ends, which is what a client
+ * waits for. Nothing is checked, use ql570decode on the recorded stream for
+ * that.
+ *
+ * Usage: ql570standin [options] [command...]
+ */
+int main(int argc, char **argv)
+{
+	printer p = {
+		.printer_id = QL_580N,
+		.media_width = 62
+	};
+	const char *port = "9100";
+	const char *path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+p:o:i:w:l:vh")) != -1) {
+		switch (opt) {
+		case 'p': port = optarg; break;
+		case 'o': path = optarg; break;
+		case 'i': p.printer_id = strtoul(optarg, NULL, 0); break;
+		case 'w': p.media_width = atoi(optarg); break;
+		case 'l': p.media_length = atoi(optarg); break;
+		case 'v': p.verbose = true; break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (path != NULL && (p.record = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "Error while writing %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	int fd = listen_on(port);
+
+	if (fd < 0) {
+		fprintf(stderr, "Error while listening on port %s: %s\n", port, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	pid_t child = 0;
+
+	if (optind < argc) {
+		child = fork();
+
+		if (child == 0) {
+			close(fd);
+			execvp(argv[optind], argv + optind);
+			fprintf(stderr, "Error while running %s: %s\n", argv[optind], strerror(errno));
+			_exit(127);
+		}
+
+		if (child < 0) {
+			fprintf(stderr, "Error while running %s: %s\n", argv[optind], strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	int result = EXIT_SUCCESS;
+
+	while (true) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int status;
+
+		// Connections are served one at a time, like the printer does.
+		if (poll(&pfd, 1, 100) > 0) {
+			int client = accept(fd, NULL, NULL);
+
+			if (client >= 0) {
+				serve(client, &p);
+				close(client);
+			}
+		}
+
+		if (child > 0 && waitpid(child, &status, WNOHANG) == child) {
+			result = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+			break;
+		}
+	}
+
+	close(fd);
+
+	if (p.record != NULL)
+		fclose(p.record);
+
+	fprintf(stderr, "%lu pages, %lu status requests\n", p.pages, p.status_requests);
+
+	return result;
+}
@@ -25,172 +25,1503 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
 #include <cups/cups.h>
 #include <cups/raster.h>
 #include <cups/sidechannel.h>
 
 #include "ql570.h"
+#include "transform.h"
+#include "pool.h"
+#include "writer.h"
+#include "thermal.h"
+#include "speed.h"
+#include "font.h"
+#include "barcode.h"
+#include "metrics.h"
+#include "trace.h"
+#include "linecache.h"
+#include "kernel.h"
 #include "rastertoql570.h"
 
+/**
+ * Status read from the printer is recorded to the file named by
+ * `QL_TRACE_RECORD`, or replayed from `QL_TRACE_REPLAY` instead of reading the
+ * backchannel. See backchannel_read_status().
+ */
+static ql_trace status_trace;
+
+/**
+ * Set when the job is cancelled. CUPS sends SIGTERM for that.
+ */
+static volatile sig_atomic_t cancelled;
+
+static void
+cancel_job(int signal)
+{
+	(void)signal;
+	cancelled = 1;
+}
+
+int
+main(int argc, char** argv)
+{
+	// As per recommendation in the CUPS documentation 
+	// TODO: use sigaction()
+	signal(SIGPIPE, SIG_IGN);
+
+	// A cancelled job still ends properly, so that the counters of the
+	// printer include what was printed.
+	struct sigaction action = { .sa_handler = cancel_job };
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, NULL);
+
+	double job_start = monotonic_time();
+	const char *trace_path = getenv("QL_TRACE_REPLAY");
+
+	if (trace_path != NULL) {
+		if (!ql_trace_load(&status_trace, trace_path) || status_trace.count == 0) {
+			fprintf(stderr, "CRIT: Could not read status trace %s.\n", trace_path);
+			return 1;
+		}
+	} else if ((trace_path = getenv("QL_TRACE_RECORD")) != NULL
+		   && !ql_trace_record(&status_trace, trace_path)) {
+		fprintf(stderr, "WARNING: Could not record status trace to %s.\n", trace_path);
+	}
+
+	FILE *fout = fdopen(STDOUT_FILENO, "wb");
+
+	if (fout == NULL) {
+		fprintf(stderr, "CRIT: Error while opening file.\n");
+		return 1;
+	}
+
+	// The status returned by `init` (below) tells us whether the printer
+	// is responding, which printer we are talking to (and thus the raster
+	// line length and minimal raster line count) and which media is
+	// loaded.
+	ql_status status = { 0 };
+	uint64_t init_retries = 0;
+
+	if (!init(&status, fout, &init_retries)) {
+		fprintf(stderr, "CRIT: Could not get status information.\n");
+
+		ql_metrics metrics;
+		ql_speed speed;
+
+		if (load_metrics(&metrics, &speed)) {
+			metrics.init_retries += init_retries;
+			save_metrics(&metrics, &speed);
+		}
+
+		return 1;
+	}
+
+	const ql_model *model = ql_model_lookup(status.printer_id);
+	const ql_media *media = ql_media_lookup(status.media_width, status.media_length);
+
+	fprintf(stderr, "DEBUG: Printer %s, media %dx%dmm.\n", model->name,
+			status.media_width, status.media_length);
+
+	if (media == NULL)
+		fprintf(stderr, "WARNING: Unknown media, raster data will not be aligned.\n");
+
+	// Job options are passed as the fifth argument.
+	cups_option_t *options = NULL;
+	int num_options = 0;
+
+	if (argc > 5)
+		num_options = cupsParseOptions(argv[5], 0, &options);
+
+	// Worker and writer threads leave SIGTERM to this thread.
+	sigset_t term, mask;
+	sigemptyset(&term);
+	sigaddset(&term, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &term, &mask);
+
+	print_job job = {
+		.model = model,
+		.media = media,
+		.media_type = status.media_type,
+		.media_check = MEDIA_CHECK_ABORT,
+		.cut_mode = CUT_EVERY,
+		.cut_interval = 1,
+		.pool = ql_pool_create(worker_count(num_options, options)),
+		.writer = ql_writer_open(fileno(fout), WRITER_BUFFER_SIZE),
+		.device = fout,
+		.direct = fout,
+		.resume_timeout = RESUME_TIMEOUT,
+		.thermal_mode = THERMAL_PACE
+	};
+
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+	const char *value = cupsGetOption("ql-resume-timeout", num_options, options);
+
+	if (value != NULL)
+		job.resume_timeout = atoi(value);
+
+	ql_thermal_init(&job.thermal, THERMAL_TAU);
+	value = cupsGetOption("ql-thermal", num_options, options);
+
+	if (value != NULL && strcmp(value, "off") == 0)
+		job.thermal_mode = THERMAL_OFF;
+	else if (value != NULL && strcmp(value, "reorder") == 0)
+		job.thermal_mode = THERMAL_REORDER;
+
+	if (job.thermal_mode == THERMAL_REORDER) {
+		value = cupsGetOption("ql-thermal-window", num_options, options);
+		job.window = value != NULL && atoi(value) > 0 ? atoi(value) : THERMAL_WINDOW;
+	}
+
+	job.line_cache = malloc(sizeof(ql_line_cache));
+
+	if (job.line_cache != NULL && !ql_line_cache_init(job.line_cache,
+				model->bytes_per_line)) {
+		free(job.line_cache);
+		job.line_cache = NULL;
+	}
+
+	fprintf(stderr, "DEBUG: Encoding raster lines with the %s kernel.\n",
+			ql_kernel_select(model)->name);
+
+	job.metrics_loaded = load_metrics(&job.metrics, &job.speed);
+	job.metrics.init_retries += init_retries;
+
+	value = cupsGetOption("ql-media-check", num_options, options);
+
+	if (value != NULL && strcmp(value, "off") == 0)
+		job.media_check = MEDIA_CHECK_OFF;
+	else if (value != NULL && strcmp(value, "warn") == 0)
+		job.media_check = MEDIA_CHECK_WARN;
+
+	parse_cut(&job, cupsGetOption("ql-cut", num_options, options));
+
+	value = cupsGetOption("ql-labels", num_options, options);
+	job.labels = value != NULL && atoi(value) > 0 ? atoi(value) : 1;
+
+	value = cupsGetOption("ql-serial", num_options, options);
+	snprintf(job.serial, sizeof(job.serial), "%s", value != NULL ? value : "1");
+
+	parse_fields(&job, num_options, options);
+
+	cupsFreeOptions(num_options, options);
+
+	if (job.pool == NULL)
+		fprintf(stderr, "WARNING: Could not start worker threads.\n");
+	else
+		fprintf(stderr, "DEBUG: Using %d worker threads.\n", ql_pool_size(job.pool));
+
+	// Everything from here on goes through the writer thread, if there
+	// is one.
+	if (job.writer == NULL)
+		fprintf(stderr, "WARNING: Could not start writer thread.\n");
+	else
+		job.device = ql_writer_stream(job.writer);
+
+	cups_raster_t *raster = cupsRasterOpen(0, CUPS_RASTER_READ);
+	cups_page_header2_t header;
+
+	// Pages waiting to be sent, when reordering. Otherwise pages are sent
+	// while they are encoded, and the page before waits for its page end
+	// in the slot after the one being encoded.
+	page_record *queue = calloc(job.window + 2, sizeof(page_record));
+	unsigned int queued = 0;
+	int result = EXIT_SUCCESS;
+	bool more = queue != NULL && cupsRasterReadHeader2(raster, &header);
+
+	while (more && !cancelled) {
+		// Nothing of the page has been sent yet, so a job for other
+		// media can be stopped without wasting any.
+		if (!check_media(&job, &header)) {
+			result = EXIT_FAILURE;
+			break;
+		}
+
+		bool encoded = handle_page(raster, header, &job, &queue[queued]);
+
+		// The end of the last page tells the printer that the job is
+		// done, so look for another page before queueing this one.
+		more = cupsRasterReadHeader2(raster, &header);
+
+		// Further labels from the same page only differ in their
+		// fields.
+		for (unsigned int i = 0; encoded && !cancelled && i < job.labels; i++) {
+			if (i > 0 && !template_page(&job, &queue[queued]))
+				break;
+
+			job.ended = !more && i == job.labels - 1;
+			next_serial(job.serial);
+			queue_page(&job, queue, &queued);
+		}
+	}
+
+	job.ended = true;
+	finish_previous(&job, true);
+
+	while (queued > 0 && !cancelled)
+		send_next_page(&job, queue, &queued);
+
+	if (cancelled)
+		fprintf(stderr, "INFO: Job cancelled.\n");
+
+	while (queued > 0)
+		record_free(&queue[--queued]);
+
+	free(queue);
+	free(job.template.lines);
+	free_fields(&job);
+
+	cupsRasterClose(raster);
+	ql_pool_destroy(job.pool);
+
+	if (job.line_cache != NULL) {
+		fprintf(stderr, "DEBUG: Reused %llu of %llu placed raster lines.\n",
+				(unsigned long long)job.line_cache->hits,
+				(unsigned long long)job.line_cache->lookups);
+		ql_line_cache_free(job.line_cache);
+		free(job.line_cache);
+	}
+
+	if (job.writer != NULL) {
+		ql_writer_stats stats;
+		ql_writer_drain(job.writer);
+		ql_writer_stats_get(job.writer, &stats);
+		print_writer_stats(&stats);
+
+		if (!ql_writer_close(job.writer))
+			fprintf(stderr, "ERROR: Could not write to printer.\n");
+	}
+
+	fclose(fout);
+
+	if (job.metrics_loaded)
+		save_metrics(&job.metrics, &job.speed);
+
+	ql_trace_close(&status_trace);
+	fprintf(stderr, "DEBUG: Job took %.3f s.\n", monotonic_time() - job_start);
+
+	return result;
+}
+
+/**
+ * Number of worker threads to use for a job.
+ *
+ * This is taken from the job option `ql-threads`, or defaults to the number
+ * of processors.
+ *
+ * @param num_options number of job options
+ * @param options job options
+ * @returns number of threads, at least one
+ */
+unsigned int
+worker_count(int num_options, cups_option_t *options)
+{
+	const char *value = cupsGetOption("ql-threads", num_options, options);
+
+	if (value != NULL && atoi(value) > 0)
+		return atoi(value);
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return cores > 0 ? cores : 1;
+}
+
+/**
+ * Set how labels are cut, from the job option `ql-cut`.
+ *
+ * The option is either a number of labels to cut after (1 by default), `end`
+ * to only cut at the end of the job or `none`. Half cuts (`half`) are not
+ * supported by the printers of the QL series, labels are cut through
+ * instead.
+ *
+ * @param job the print job
+ * @param value value of the option, or NULL
+ */
+void
+parse_cut(print_job *job, const char *value)
+{
+	if (value == NULL)
+		return;
+
+	if (strcmp(value, "end") == 0) {
+		job->cut_mode = CUT_END;
+	} else if (strcmp(value, "none") == 0) {
+		job->cut_mode = CUT_NONE;
+	} else if (strcmp(value, "half") == 0) {
+		fprintf(stderr, "WARNING: The %s cannot half cut, cutting through instead.\n",
+				job->model->name);
+	} else if (atoi(value) > 0) {
+		job->cut_interval = atoi(value) > 255 ? 255 : atoi(value);
+	} else {
+		fprintf(stderr, "WARNING: Unknown cut policy %s.\n", value);
+	}
+}
+
+/**
+ * Report how the printer kept up with the data we sent.
+ *
+ * @param stats counters of the writer thread
+ */
+void
+print_writer_stats(const ql_writer_stats *stats)
+{
+	fprintf(stderr, "DEBUG: Sent %llu bytes in %llu writes.\n",
+			(unsigned long long)stats->bytes,
+			(unsigned long long)stats->writes);
+
+	fprintf(stderr, "DEBUG: Printer throttled %llu writes for %.3f s, "
+			"encoder waited %.3f s for buffer space.\n",
+			(unsigned long long)stats->stalls,
+			stats->stall_ns / 1e9, stats->backpressure_ns / 1e9);
+
+	if (stats->depth_samples > 0)
+		fprintf(stderr, "DEBUG: Queue depth %llu bytes on average, %llu at most.\n",
+				(unsigned long long)(stats->depth_sum / stats->depth_samples),
+				(unsigned long long)stats->max_depth);
+}
+
+/**
+ * Check whether a page fits the loaded media.
+ *
+ * A page must not be wider than the media, and should have the length of
+ * die-cut labels. Pages narrower than the media are fine, they are centred
+ * (see ql_placement_init()). Nothing can be checked for unknown media.
+ *
+ * @param job the print job
+ * @param header page header
+ * @returns false if the job should be stopped, see #media_check
+ */
+bool
+check_media(const print_job *job, const cups_page_header2_t *header)
+{
+	const ql_media *media = job->media;
+
+	if (job->media_check == MEDIA_CHECK_OFF || media == NULL
+	    || header->HWResolution[0] == 0 || header->HWResolution[1] == 0)
+		return true;
+
+	double width = header->cupsWidth * 25.4 / header->HWResolution[0];
+	double length = header->cupsHeight * 25.4 / header->HWResolution[1];
+
+	// The width of the media is known to the dot, its width in
+	// millimetres is rounded.
+	double dots = header->cupsWidth * 300.0 / header->HWResolution[0];
+	bool fits = dots <= media->dots + MEDIA_TOLERANCE * 300 / 25.4;
+
+	if (media->length != 0 && (length > media->length + MEDIA_TOLERANCE
+				   || length < media->length - MEDIA_TOLERANCE))
+		fits = false;
+
+	if (fits)
+		return true;
+
+	const char *level = job->media_check == MEDIA_CHECK_ABORT ? "ERROR" : "WARNING";
+
+	if (media->length != 0)
+		fprintf(stderr, "%s: Page is %.0fx%.0fmm, but %dx%dmm labels are loaded.\n",
+				level, width, length, media->width, media->length);
+	else
+		fprintf(stderr, "%s: Page is %.0fmm wide, but %dmm tape is loaded.\n",
+				level, width, media->width);
+
+	return job->media_check != MEDIA_CHECK_ABORT;
+}
+
+/**
+ * Encode a page.
+ *
+ * The page is cut into stripes of STRIPE_LINES output lines. The input lines
+ * of each stripe are read here, the stripe is then scaled, dithered and
+ * encoded on the worker threads (see process_stripe()) and finally written to
+ * the record in order. At most two stripes per worker are in flight, so
+ * memory use does not depend on the length of the label.
+ *
+ * Unless pages are reordered (see send_next_page()), the page is sent to the
+ * printer while it is encoded and finish_page() has to be called afterwards.
+ *
+ * @param raster raster stream
+ * @param header page header
+ * @param job the print job
+ * @param record record to hold the commands of the page, release with
+ *        record_free()
+ * @returns false if the page could not be encoded
+ */
+bool
+handle_page(cups_raster_t *raster, cups_page_header2_t header, print_job *job,
+		page_record *record)
+{
+	/* // TODO: Support some safety option for testing.
+	if( header.cupsHeight > 900 )
+		header.cupsHeight = 900;
+	*/
+
+	const ql_model *model = job->model;
+	bool streaming = job->window == 0;
+
+	if (!record_open(record)) {
+		fprintf(stderr, "ERROR: Out of memory.\n");
+		skip_rows(raster, &header, 0);
+		return false;
+	}
+
+	// The page is encoded into `record` and sent from there as it grows,
+	// so that it can be sent again if the printer fails to print it.
+	FILE *fout = record->stream;
+
+	page_state page = {
+		.job = job,
+		.header = &header,
+
+		// The print head has 300 dots per inch across the media, along
+		// the media it does either 300 or 600 lines per inch. Any
+		// other input is scaled to the closest of these.
+		.resolution = { 300, header.HWResolution[1] > 300 ? 600 : 300 },
+		.kernel = ql_kernel_select(model)
+	};
+
+	ql_scaler scaler;
+
+	if (!ql_scaler_init(&scaler, header.cupsWidth, header.cupsHeight,
+			header.cupsBitsPerPixel, header.cupsColorSpace != CUPS_CSPACE_K,
+			header.HWResolution, page.resolution)) {
+		fprintf(stderr, "ERROR: Unsupported raster format (%d bits per pixel, %dx%d dpi).\n",
+				header.cupsBitsPerPixel, header.HWResolution[0],
+				header.HWResolution[1]);
+		skip_rows(raster, &header, 0);
+		record_free(record);
+		return false;
+	}
+
+	if (scaler.out_width != header.cupsWidth || scaler.out_height != header.cupsHeight)
+		fprintf(stderr, "DEBUG: Scaling page from %dx%d dpi to %dx%d dpi.\n",
+				header.HWResolution[0], header.HWResolution[1],
+				page.resolution[0], page.resolution[1]);
+
+	page.out_width = scaler.out_width;
+	page.out_height = scaler.out_height;
+	page.scaler = &scaler;
+
+	if (header.cupsBitsPerPixel == 8 && !ql_dither_init(&page.dither, page.out_width)) {
+		fprintf(stderr, "ERROR: Out of memory.\n");
+		skip_rows(raster, &header, 0);
+		ql_scaler_free(&scaler);
+		record_free(record);
+		return false;
+	}
+
+	ql_placement_init(&page.placement, model, job->media, page.out_width);
+
+	// Repeated input lines are only worth looking up if that is all
+	// there is to a raster line: monochrome, one input line per line.
+	if (job->line_cache != NULL && header.cupsBitsPerPixel == 1
+	    && page.out_height == header.cupsHeight) {
+		line_layout layout;
+
+		memset(&layout, 0x00, sizeof(layout));
+		layout.width = header.cupsWidth;
+		layout.out_width = page.out_width;
+		layout.placement = page.placement;
+
+		if (ql_line_cache_prepare(job->line_cache, &layout, sizeof(layout),
+				header.cupsBytesPerLine))
+			page.line_cache = job->line_cache;
+	}
+
+	pthread_mutex_init(&page.lock, NULL);
+	pthread_cond_init(&page.changed, NULL);
+
+	render_fields(job, page.resolution[1]);
+
+	// Keep the page for further labels.
+	free(job->template.lines);
+	job->template.lines = NULL;
+
+	if (job->labels > 1) {
+		job->template = (label_template) {
+			.lines = calloc(page.out_height, model->bytes_per_line),
+			.height = page.out_height,
+			.resolution = page.resolution[1],
+			.placement = page.placement
+		};
+
+		page.cache = job->template.lines;
+	}
+
+	int blanks = begin_page(job, record, page.out_height, page.resolution[1]);
+
+	unsigned int count = (page.out_height + STRIPE_LINES - 1) / STRIPE_LINES;
+	unsigned int window = job->pool ? 2 * ql_pool_size(job->pool) : 1;
+	stripe *stripes = calloc(count, sizeof(stripe));
+	uint8_t last_row[header.cupsBytesPerLine];
+	uint32_t row = 0;
+	unsigned int submitted = 0;
+	unsigned int written = 0;
+
+	if (stripes == NULL)
+		fprintf(stderr, "ERROR: Out of memory.\n");
+
+	while (stripes != NULL && submitted < count) {
+		stripe *s = &stripes[submitted];
+
+		s->page = &page;
+		s->index = submitted;
+		s->first_line = submitted * STRIPE_LINES;
+		s->lines = page.out_height - s->first_line;
+
+		if (s->lines > STRIPE_LINES)
+			s->lines = STRIPE_LINES;
+
+		if (!read_stripe(raster, s, &row, last_row)) {
+			if (s->input == NULL)
+				fprintf(stderr, "ERROR: Out of memory.\n");
+			else
+				fprintf(stderr, "ERROR: Raster data ends early.\n");
+
+			count = submitted + 1;
+		}
+
+		if (job->pool == NULL || !ql_pool_submit(job->pool, process_stripe, s))
+			process_stripe(s);
+
+		submitted++;
+
+		while (submitted - written >= window || (submitted == count && written < count)) {
+			record->dots += write_stripe(&stripes[written++], fout);
+
+			if (streaming)
+				record_send(record, job->device);
+		}
+	}
+
+	// Rows of a page that was cut short, or that were not needed for
+	// scaling, still have to be read to get to the next page.
+	skip_rows(raster, &header, row);
+
+	free(stripes);
+	ql_scaler_free(&scaler);
+	ql_dither_free(&page.dither);
+	pthread_mutex_destroy(&page.lock);
+	pthread_cond_destroy(&page.changed);
+
+	end_page(job, record, blanks);
+
+	return true;
+}
+
+/**
+ * Start the commands of a page.
+ *
+ * Unless pages are reordered, the page is started on the printer right away.
+ * We insert blank lines before (and, in end_page(), after) the raster
+ * output, if the line count of the page is below the minimum.
+ *
+ * @param job the print job
+ * @param record record of the page
+ * @param out_height number of raster lines of the page
+ * @param resolution lines per inch along the media
+ * @returns number of blank lines to be added, for end_page()
+ */
 int
-main(__attribute__((unused)) int argc, __attribute__((unused)) char** argv)
+begin_page(print_job *job, page_record *record, uint32_t out_height,
+		uint16_t resolution)
+{
+	const ql_model *model = job->model;
+	FILE *fout = record->stream;
+	uint32_t height = out_height;
+
+	// Enforce the minimum number of lines.
+	if( height < model->min_lines ) {
+		height = model->min_lines;
+	}
+
+	record->print_info = (ql_print_info) {
+		.valid_flag = PIV_QUALITY,
+		.raster_number[0] = height & 0x00FF,
+		.raster_number[1] = (height & 0xFF00) >> 8
+	};
+
+	// Have the printer refuse the page if other media is loaded by now,
+	// rather than print it onto the wrong labels.
+	if (job->media != NULL && job->media_check != MEDIA_CHECK_OFF) {
+		record->print_info.valid_flag |= PIV_MEDIA_TYPE | PIV_MEDIA_WIDTH;
+		record->print_info.media_type = job->media_type;
+		record->print_info.media_width = job->media->width;
+
+		if (job->media->length != 0) {
+			record->print_info.valid_flag |= PIV_MEDIA_LENGTH;
+			record->print_info.media_length = job->media->length;
+		}
+	}
+	record->lines = height;
+	record->resolution = resolution;
+
+	// Nothing can go wrong with the page from here on, so the page
+	// before is not the last. Assume that this page is like that one,
+	// for now.
+	if (job->window == 0) {
+		finish_previous(job, false);
+		start_page(job, record, job->last_dots);
+	}
+
+	// The printer counts the labels for the cut interval itself.
+	if (job->cut_mode == CUT_EVERY) {
+		ql_autocut_enable(fout);
+		ql_autocut_interval(job->cut_interval, fout);
+	} else {
+		ql_autocut_disable(fout);
+	}
+
+	ql_set_extended_options(job->cut_mode != CUT_NONE, resolution == 600, fout);
+
+	int blanks = model->min_lines - out_height;
+
+	if (blanks > 0)
+		print_blank_lines(blanks / 2, model->bytes_per_line, fout);
+
+	if (job->window == 0)
+		record_send(record, job->device);
+
+	return blanks;
+}
+
+/**
+ * End the commands of a page.
+ *
+ * The page end itself is sent by finish_page(), once it is known whether
+ * this is the last page.
+ *
+ * @param job the print job
+ * @param record record of the page
+ * @param blanks as returned by begin_page()
+ */
+void
+end_page(print_job *job, page_record *record, int blanks)
+{
+	size_t output_buffer_size = job->model->bytes_per_line;
+	FILE *fout = record->stream;
+
+	if (blanks > 0)
+		print_blank_lines(blanks / 2 + (blanks % 2), output_buffer_size, fout);
+
+	ql_raster_end(output_buffer_size, fout);
+
+	// The record may be moved around in the queue from now on, which
+	// the stream would not know about.
+	fclose(record->stream);
+	record->stream = NULL;
+
+	if (job->window == 0)
+		record_send(record, job->device);
+}
+
+/**
+ * Hand an encoded page over for printing.
+ *
+ * Unless pages are reordered, the page has already been sent while it was
+ * encoded. It is finished once the next page starts or the job ends, so that
+ * the last page that was sent ends the job, even if pages after it fail.
+ * Otherwise it is queued, and the next page is sent once the queue is full.
+ *
+ * @param job the print job
+ * @param queue pages waiting to be sent, the new page at `queue[*queued]`
+ * @param queued number of pages in `queue`, updated
+ */
+void
+queue_page(print_job *job, page_record *queue, unsigned int *queued)
+{
+	if (job->window == 0) {
+		queue[1] = queue[0];
+		job->previous = &queue[1];
+		return;
+	}
+
+	if (++(*queued) > job->window)
+		send_next_page(job, queue, queued);
+}
+
+/**
+ * Encode another label from the last page.
+ *
+ * The raster lines kept by handle_page() are copied and only the fields are
+ * drawn again, which is a lot cheaper than reading, scaling and dithering the
+ * page once more.
+ *
+ * @param job the print job, with a template
+ * @param record record to hold the commands of the label, release with
+ *        record_free()
+ * @returns false if the label could not be encoded
+ */
+bool
+template_page(print_job *job, page_record *record)
+{
+	const label_template *template = &job->template;
+	size_t head_bytes = job->model->bytes_per_line;
+	const ql_kernel *kernel = ql_kernel_select(job->model);
+	uint8_t lines[STRIPE_LINES * QL_KERNEL_MAX_LINE];
+
+	if (template->lines == NULL || !record_open(record)) {
+		fprintf(stderr, "ERROR: Out of memory.\n");
+		return false;
+	}
+
+	render_fields(job, template->resolution);
+
+	int blanks = begin_page(job, record, template->height, template->resolution);
+
+	for (uint32_t first = 0; first < template->height; first += STRIPE_LINES) {
+		uint32_t count = template->height - first;
+
+		if (count > STRIPE_LINES)
+			count = STRIPE_LINES;
+
+		memcpy(lines, template->lines + first * head_bytes, count * head_bytes);
+
+		for (uint32_t i = 0; i < count; i++)
+			draw_fields(job, first + i, lines + i * head_bytes, &template->placement);
+
+		record->dots += encode_lines(kernel, lines, count, head_bytes,
+				record->stream);
+
+		if (job->window == 0)
+			record_send(record, job->device);
+	}
+
+	end_page(job, record, blanks);
+
+	return true;
+}
+
+/**
+ * Send the next page when reordering pages.
+ *
+ * Pages are sent in order, unless the next page would heat up the print head
+ * so much that the printer stops to cool down. In that case a later page that
+ * can be printed sooner is sent first. A page is passed over at most
+ * `job->window` times.
+ *
+ * @param job the print job
+ * @param queue pages waiting to be sent, in job order
+ * @param queued number of pages in `queue`, updated
+ */
+void
+send_next_page(print_job *job, page_record *queue, unsigned int *queued)
+{
+	unsigned int next = 0;
+	double best = ql_thermal_delay(&job->thermal, queue[0].dots);
+
+	for (unsigned int i = 1; best > 0 && queue[0].passed < job->window && i < *queued; i++) {
+		double delay = ql_thermal_delay(&job->thermal, queue[i].dots);
+
+		if (delay < best) {
+			next = i;
+			best = delay;
+		}
+	}
+
+	if (next != 0) {
+		fprintf(stderr, "DEBUG: Sending a lighter page first to avoid cooling.\n");
+
+		for (unsigned int i = 0; i < next; i++)
+			queue[i].passed++;
+	}
+
+	page_record *record = &queue[next];
+	record->last = job->ended && *queued == 1;
+
+	start_page(job, record, record->dots);
+	record_send(record, job->device);
+	finish_page(job, record);
+	record_free(record);
+
+	memmove(&queue[next], &queue[next + 1], (*queued - next - 1) * sizeof(page_record));
+	(*queued)--;
+}
+
+/**
+ * Start sending a page.
+ *
+ * If the print head is expected to get too hot, this waits for it to cool
+ * down first. A short pause here is cheaper than the printer stopping in the
+ * middle of the page.
+ *
+ * @param job the print job
+ * @param record the page
+ * @param dots expected number of black dots on the page
+ */
+void
+start_page(print_job *job, page_record *record, uint64_t dots)
+{
+	double delay = 0;
+
+	if (job->thermal_mode != THERMAL_OFF)
+		delay = ql_thermal_delay(&job->thermal, dots);
+
+	if (delay > 0) {
+		fprintf(stderr, "INFO: Pausing %.1f s to let the print head cool down.\n", delay);
+
+		if (job->writer != NULL)
+			ql_writer_drain(job->writer);
+
+		nanosleep(&(struct timespec){(time_t)delay, (delay - (time_t)delay) * 1e9}, NULL);
+	}
+
+	record->print_info.successive_page = job->page_counter > 0;
+	ql_page_start(&record->print_info, job->device);
+}
+
+/**
+ * Finish the page sent before, if any, when pages are sent in order.
+ *
+ * @param job the print job
+ * @param last whether the job ends with that page
+ */
+void
+finish_previous(print_job *job, bool last)
+{
+	page_record *record = job->previous;
+
+	if (record == NULL)
+		return;
+
+	job->previous = NULL;
+	record->last = last;
+	finish_page(job, record);
+	record_free(record);
+}
+
+/**
+ * End a page, wait for the printer to finish it and recover from errors.
+ *
+ * The page end tells the printer whether more pages follow, see
+ * page_record.last.
+ *
+ * If the printer stops with an error that can be resolved by the user (the
+ * cover was opened, the media ran out) or with a transmission error, we wait
+ * for the printer to become ready again and send the page once more.
+ *
+ * @param job the print job
+ * @param record commands of the page, already sent to the printer apart from
+ *        the page end
+ * @returns true if the page was printed
+ */
+bool
+finish_page(print_job *job, page_record *record)
+{
+	ql_status status = {0};
+	bool ok = false;
+
+	ql_page_end(record->last, job->device);
+
+	ql_thermal_add(&job->thermal, record->dots);
+	job->last_dots = record->dots;
+
+	if (job->writer != NULL && !ql_writer_drain(job->writer))
+		fprintf(stderr, "ERROR: Could not write to printer.\n");
+
+	if (!wait_for_page_end(job, record, &status))
+		ok = false;
+	else if (status.status_type != ST_ERROR)
+		ok = true;
+	else if (is_recoverable(&status) && job->resume_timeout != 0)
+		ok = resume_page(job, record);
+
+	job->metrics.bytes += record->size;
+
+	if (ok) {
+		job->metrics.labels++;
+		job->metrics.lines += record->lines;
+		job->metrics.tape_um += (uint64_t)record->lines * 25400 / record->resolution;
+	}
+
+	job->page_counter++;
+
+	// Printing this information will also end up on the jobs page
+	// of the CUPS web interface. I've seen a lot of printers that
+	// do not include this information and so the "Pages" number
+	// will end up being "Unknown".
+	fprintf(stderr, "PAGE: %d #-pages\n", job->page_counter);
+
+	return ok;
+}
+
+/**
+ * Whether an error can go away without restarting the job.
+ *
+ * @param status error status
+ * @returns true for transmission errors, an opened cover or the end of media
+ */
+bool
+is_recoverable(const ql_status *status)
+{
+	return (status->error_info_1 & END_OF_MEDIA)
+		|| (status->error_info_2 & (TRANSMISSION_ERROR | COVER_OPENED));
+}
+
+/**
+ * Send a page again after an error.
+ *
+ * We poll the printer every RESUME_INTERVAL seconds, for at most
+ * `job->resume_timeout` seconds. Once it reports no errors, the printer is
+ * initialised again and the page is sent from the start. Only this page needs
+ * to be sent again, as pages are sent one at a time and earlier pages have
+ * been completed.
+ *
+ * @param job the print job
+ * @param record commands of the page
+ * @returns true if the page was printed
+ */
+bool
+resume_page(print_job *job, page_record *record)
+{
+	ql_status status = {0};
+	time_t deadline = time(NULL) + job->resume_timeout;
+
+	fprintf(stderr, "INFO: Waiting for the printer to recover.\n");
+
+	while (time(NULL) < deadline && !cancelled) {
+		nanosleep(&(struct timespec){RESUME_INTERVAL, 0}, NULL);
+
+		// The writer is drained, so we can talk to the printer
+		// directly.
+		if (!init(&status, job->direct, &job->metrics.init_retries))
+			continue;
+
+		if (status.error_info_1 != 0 || status.error_info_2 != 0)
+			continue;
+
+		fprintf(stderr, "INFO: Printer recovered, sending page again.\n");
+
+		ql_page_start(&record->print_info, job->device);
+		record->sent = 0;
+		record_send(record, job->device);
+		ql_page_end(record->last, job->device);
+		job->metrics.bytes += record->size;
+
+		if (job->writer != NULL && !ql_writer_drain(job->writer))
+			fprintf(stderr, "ERROR: Could not write to printer.\n");
+
+		if (!wait_for_page_end(job, record, &status))
+			return false;
+
+		if (status.status_type != ST_ERROR)
+			return true;
+
+		if (!is_recoverable(&status))
+			return false;
+	}
+
+	if (!cancelled)
+		fprintf(stderr, "ERROR: Printer did not recover in time.\n");
+
+	return false;
+}
+
+/**
+ * Start recording the commands of a page.
+ *
+ * @param record record to initialise, release with record_free()
+ * @returns false if out of memory
+ */
+bool
+record_open(page_record *record)
+{
+	memset(record, 0x00, sizeof(page_record));
+	record->stream = open_memstream(&record->data, &record->size);
+
+	return record->stream != NULL;
+}
+
+/**
+ * Send what has been recorded since the last call.
+ *
+ * @param record the record
+ * @param device file descriptor to write to
+ */
+void
+record_send(page_record *record, FILE *device)
+{
+	if (record->stream != NULL)
+		fflush(record->stream);
+
+	if (record->size > record->sent)
+		fwrite(record->data + record->sent, 1, record->size - record->sent, device);
+
+	record->sent = record->size;
+}
+
+/**
+ * Release a record.
+ *
+ * @param record record initialised with record_open()
+ */
+void
+record_free(page_record *record)
+{
+	if (record->stream != NULL)
+		fclose(record->stream);
+
+	free(record->data);
+}
+
+/**
+ * Read the input lines needed for a stripe.
+ *
+ * When enlarging, consecutive stripes can share an input line, which is why
+ * the last line read is kept in `last_row`.
+ *
+ * @param raster raster stream
+ * @param s stripe, with its output lines set
+ * @param row index of the next input line in the raster stream
+ * @param last_row copy of the input line before `row`
+ * @returns false if the raster data ended early, `s->lines` is reduced to
+ *          the output lines that can still be produced, or if out of
+ *          memory, with `s->input` NULL and `s->lines` zero
+ */
+bool
+read_stripe(cups_raster_t *raster, stripe *s, uint32_t *row, uint8_t *last_row)
+{
+	const ql_scaler *scaler = s->page->scaler;
+	size_t bytes = s->page->header->cupsBytesPerLine;
+	uint32_t first, last, unused;
+
+	ql_scaler_span(scaler, s->first_line, &first, &unused);
+	ql_scaler_span(scaler, s->first_line + s->lines - 1, &unused, &last);
+
+	s->first_row = first;
+	s->rows = 0;
+	s->input = malloc((last - first) * bytes);
+
+	if (s->input == NULL) {
+		s->lines = 0;
+		return false;
+	}
+
+	for (uint32_t r = first; r < last; r++) {
+		uint8_t *dst = s->input + (r - first) * bytes;
+
+		if (r < *row) {
+			memcpy(dst, last_row, bytes);
+		} else {
+			while (*row <= r) {
+				if (cupsRasterReadPixels(raster, dst, bytes) == 0)
+					break;
+
+				(*row)++;
+			}
+
+			if (*row <= r)
+				break;
+
+			memcpy(last_row, dst, bytes);
+		}
+
+		s->rows++;
+	}
+
+	if (s->rows == last - first)
+		return true;
+
+	// Only keep the output lines whose input is complete.
+	uint32_t lines = 0;
+
+	for (; lines < s->lines; lines++) {
+		ql_scaler_span(scaler, s->first_line + lines, &unused, &last);
+
+		if (last > first + s->rows)
+			break;
+	}
+
+	s->lines = lines;
+
+	return false;
+}
+
+/**
+ * Read the rest of the pixel data of a page.
+ *
+ * The raster stream has no markers between pages, the next page header is
+ * only found once all rows of a page have been read, including those of a
+ * page that is not printed.
+ *
+ * @param raster the raster stream
+ * @param header page header
+ * @param row number of rows already read
+ */
+void
+skip_rows(cups_raster_t *raster, const cups_page_header2_t *header, uint32_t row)
+{
+	uint8_t buffer[4096];
+	uint64_t left = row < header->cupsHeight
+			? (uint64_t)header->cupsBytesPerLine * (header->cupsHeight - row)
+			: 0;
+
+	while (left > 0) {
+		unsigned int bytes = left < sizeof(buffer) ? left : sizeof(buffer);
+
+		if (cupsRasterReadPixels(raster, buffer, bytes) == 0)
+			break;
+
+		left -= bytes;
+	}
+}
+
+/**
+ * Scale, dither and encode a stripe.
+ *
+ * This runs on a worker thread. Scaling and encoding are independent for each
+ * stripe, error diffusion is not: the error left at the end of a stripe is
+ * carried into the next one, so stripes take turns dithering, in order.
+ *
+ * Input lines already seen on a page laid out the same way are taken from
+ * the line cache, instead of being scaled and placed again.
+ *
+ * @param arg the stripe
+ */
+void
+process_stripe(void *arg)
 {
-	// As per recommendation in the CUPS documentation 
-	// TODO: use sigaction()
-	signal(SIGPIPE, SIG_IGN);
+	stripe *s = arg;
+	page_state *page = s->page;
+	const cups_page_header2_t *header = page->header;
+	size_t head_bytes = page->job->model->bytes_per_line;
+	uint8_t *lines = NULL;
+	uint8_t *packed = NULL;
+	FILE *out = NULL;
+	ql_scaler scaler = { 0 };
 
-	FILE *fout = fdopen(STDOUT_FILENO, "wb");
+	// Stripes whose input could not be read are skipped.
+	bool ok = s->input != NULL && ql_scaler_init(&scaler, header->cupsWidth,
+			header->cupsHeight, header->cupsBitsPerPixel,
+			header->cupsColorSpace != CUPS_CSPACE_K, header->HWResolution,
+			page->resolution);
 
-	if (fout == NULL) {
-		fprintf(stderr, "CRIT: Error while opening file.\n");
-		return 1;
-	}
+	uint8_t heads[STRIPE_LINES * QL_KERNEL_MAX_LINE];
+	uint64_t hashes[STRIPE_LINES];
+	bool found[STRIPE_LINES] = { false };
+	bool repeated[STRIPE_LINES] = { false };
+	ql_line_cache *cache = ok ? page->line_cache : NULL;
+	size_t bytes = header->cupsBytesPerLine;
 
-	// NOTE: Currently the resulting update of `status` by `init` (below)
-	// is not used. We still query for some status in order to determine if
-	// the printer is responding. Also, at a later stage, we can use the
-	// information in `status` to determine the printer type and set some
-	// variables, such as the raster buffer size, the minimal raster line
-	// count, etc.
-	ql_status status = { 0 };
+	// With a line cache, each raster line is made from the input line
+	// with the same index. Lines that repeat the line before are copied
+	// from it, they are not in the cache yet.
+	const uint8_t *input = cache != NULL
+		? s->input + (s->first_line - s->first_row) * bytes : NULL;
 
-	if (!init(&status, fout)) {
-		fprintf(stderr, "CRIT: Could not get status information.\n");
-		return 1;
+	if (cache != NULL) {
+		for (uint32_t i = 0; i < s->lines; i++)
+			hashes[i] = ql_line_hash(input + i * bytes, bytes);
+
+		pthread_mutex_lock(&cache->lock);
+
+		for (uint32_t i = 0; i < s->lines; i++) {
+			repeated[i] = i > 0 && hashes[i] == hashes[i - 1]
+				&& memcmp(input + i * bytes, input + (i - 1) * bytes, bytes) == 0;
+
+			if (!repeated[i])
+				found[i] = ql_line_cache_get(cache, hashes[i], input + i * bytes,
+						heads + i * head_bytes);
+		}
+
+		pthread_mutex_unlock(&cache->lock);
 	}
 
-	cups_raster_t *raster = cupsRasterOpen(0, CUPS_RASTER_READ);
-	cups_page_header2_t header;
-	unsigned int page_counter = 0;
+	if (ok) {
+		lines = malloc(s->lines * scaler.line_bytes + 1);
+		packed = scaler.bits == 1 ? lines : malloc(s->lines * scaler.out_bytes + 1);
+		ok = lines != NULL && packed != NULL;
+	}
 
-	while (cupsRasterReadHeader2(raster, &header)) {
-		handle_page(raster, header, page_counter, fout);
-		page_counter++;
+	for (uint32_t i = 0, previous = UINT32_MAX; ok && i < s->lines; i++) {
+		uint32_t first, last;
 
-		// Printing this information will also end up on the jobs page
-		// of the CUPS web interface. I've seen a lot of printers that
-		// do not include this information and so the "Pages" number
-		// will end up being "Unknown".
-		fprintf(stderr, "PAGE: %d #-pages\n", page_counter);
+		if (found[i] || repeated[i]) {
+			previous = UINT32_MAX;
+			continue;
+		}
+
+		ql_scaler_span(&scaler, s->first_line + i, &first, &last);
+
+		// Repeated spans (when enlarging) just repeat the last line.
+		for (uint32_t r = first; r < last && first != previous; r++)
+			ql_scaler_add(&scaler, s->input + (r - s->first_row) * bytes);
+
+		ql_scaler_emit(&scaler, lines + i * scaler.line_bytes);
+		previous = first;
 	}
 
-	cupsRasterClose(raster);
-	fclose(fout);
+	if (header->cupsBitsPerPixel == 8) {
+		pthread_mutex_lock(&page->lock);
 
-	return EXIT_SUCCESS;
-}
+		while (page->dither_turn != s->index)
+			pthread_cond_wait(&page->changed, &page->lock);
 
-/**
- * Print a page.
- *
- * This was factored out from main(), so (for the moment) it is a bit unwieldy
- * with regards to parameters.
- *
- */
-void
-handle_page(cups_raster_t *raster, cups_page_header2_t header, unsigned int page_counter, FILE *fout)
-{
-	/* // TODO: Support some safety option for testing.
-	if( header.cupsHeight > 900 )
-		header.cupsHeight = 900;
-	*/
+		pthread_mutex_unlock(&page->lock);
 
-	uint32_t cupsHeight = header.cupsHeight;
+		for (uint32_t i = 0; ok && i < s->lines; i++)
+			ql_dither_line(&page->dither, lines + i * scaler.line_bytes,
+					packed + i * scaler.out_bytes);
 
-	// Enforce a minimum of 150 lines.
-	if( cupsHeight < 150 ) {
-		cupsHeight = 150;
+		pthread_mutex_lock(&page->lock);
+		page->dither_turn++;
+		pthread_cond_broadcast(&page->changed);
+		pthread_mutex_unlock(&page->lock);
 	}
 
-	ql_print_info print_info = {
-		.valid_flag = PIV_QUALITY,
-		.raster_number[0] = cupsHeight & 0x00FF,
-		.raster_number[1] = (cupsHeight & 0xFF00) >> 8,
-		.successive_page = page_counter > 0
-	};
+	if (ok) {
+		out = open_memstream(&s->data, &s->size);
+		ok = out != NULL;
+	}
 
-	ql_page_start(&print_info, fout);
+	if (ok) {
+		// Lines not found in the cache are placed a run at a time.
+		for (uint32_t i = 0, n; i < s->lines; i += n + 1) {
+			for (n = 0; i + n < s->lines && !found[i + n] && !repeated[i + n]; n++)
+				;
 
-	if (header.HWResolution[1] == 600)
-		ql_set_extended_options(true, true, fout);
-	else
-		ql_set_extended_options(true, false, fout);
+			page->kernel->place(&page->placement, packed + i * scaler.out_bytes,
+					scaler.out_bytes, n, heads + i * head_bytes, head_bytes);
+		}
 
-	uint8_t buffer[header.cupsBytesPerLine];
-	size_t output_buffer_size = 90; // TODO: Depends on printer type
-	uint8_t output_buffer[output_buffer_size];
-	memset(output_buffer, 0x00, output_buffer_size);
+		for (uint32_t i = 1; i < s->lines; i++)
+			if (repeated[i])
+				memcpy(heads + i * head_bytes, heads + (i - 1) * head_bytes, head_bytes);
 
-	/*
-	 * We insert blank lines before and after the raster output, if the
-	 * line count of the original raster data is below 150.
-	 *
-	 * TODO: Depends on printer type, some other types need 295 lines.
-	 */
-	int blanks = 150 - header.cupsHeight;
+		if (cache != NULL) {
+			pthread_mutex_lock(&cache->lock);
 
-	if (blanks > 0)
-		print_blank_lines(blanks / 2, output_buffer_size, fout);
+			for (uint32_t i = 0; i < s->lines; i++) {
+				if (repeated[i]) {
+					cache->hits++;
+					cache->lookups++;
+				} else if (!found[i]) {
+					ql_line_cache_put(cache, hashes[i], input + i * bytes,
+							heads + i * head_bytes);
+				}
+			}
 
-	for (unsigned int i = 0; i < header.cupsHeight; ++i) {
-		if(cupsRasterReadPixels(raster, buffer, header.cupsBytesPerLine) == 0)
-			break;
+			pthread_mutex_unlock(&cache->lock);
+		}
 
-		// In the (undesirable) case that the input_buffer is smaller than
-		// the output_buffer
-		if (header.cupsBytesPerLine < output_buffer_size)
-			memcpy(output_buffer, buffer, header.cupsBytesPerLine);
-		else
-			memcpy(output_buffer, buffer, output_buffer_size);
+		for (uint32_t i = 0; i < s->lines; i++) {
+			uint32_t line = s->first_line + i;
+			uint8_t *head = heads + i * head_bytes;
+
+			if (page->cache != NULL)
+				memcpy(page->cache + line * head_bytes, head, head_bytes);
 
-		ql_raster(output_buffer_size, output_buffer, fout);
+			draw_fields(page->job, line, head, &page->placement);
+		}
+
+		s->dots = encode_lines(page->kernel, heads, s->lines, head_bytes, out);
+		fclose(out);
 	}
 
-	if (blanks > 0)
-		print_blank_lines(blanks / 2 + (blanks % 2), output_buffer_size, fout);
+	free(s->input);
+	s->input = NULL;
 
-	ql_raster_end(output_buffer_size, fout);
+	if (packed != lines)
+		free(packed);
+
+	free(lines);
+	ql_scaler_free(&scaler);
+
+	pthread_mutex_lock(&page->lock);
+	s->failed = !ok;
+	s->done = true;
+	pthread_cond_broadcast(&page->changed);
+	pthread_mutex_unlock(&page->lock);
+}
+
+/**
+ * Encode raster lines.
+ *
+ * @param kernel kernel for lines of `head_bytes`, see ql_kernel_select()
+ * @param heads raster lines, as sent to the print head
+ * @param count number of lines, at most STRIPE_LINES
+ * @param head_bytes length of a raster line
+ * @param out where to write the encoded lines
+ * @returns number of black dots in the lines
+ */
+uint64_t
+encode_lines(const ql_kernel *kernel, const uint8_t *heads, uint32_t count,
+		size_t head_bytes, FILE *out)
+{
+	uint8_t frames[STRIPE_LINES * (QL_KERNEL_MAX_LINE + 3)];
+	uint32_t dots[STRIPE_LINES];
+	uint64_t total = 0;
+
+	kernel->encode(heads, count, head_bytes, frames, dots);
+
+	for (uint32_t i = 0; i < count; i++)
+		total += dots[i];
+
+	// Write the frames in one go.
+	fwrite(frames, 1, count * (head_bytes + 3), out);
+
+	return total;
+}
+
+/**
+ * Wait for a stripe to be processed and send it to the printer.
+ *
+ * @param s the stripe
+ * @param device file descriptor to write to
+ * @returns number of black dots in the stripe
+ */
+uint64_t
+write_stripe(stripe *s, FILE *device)
+{
+	page_state *page = s->page;
+
+	pthread_mutex_lock(&page->lock);
+
+	while (!s->done)
+		pthread_cond_wait(&page->changed, &page->lock);
+
+	pthread_mutex_unlock(&page->lock);
+
+	if (s->failed)
+		fprintf(stderr, "ERROR: Could not process raster lines %d to %d.\n",
+				s->first_line, s->first_line + s->lines);
+	else
+		fwrite(s->data, 1, s->size, device);
 
-	// TODO: Determine total number of pages and correctly indicate last page.
-	ql_page_end(false, fout);
-	
-	// Give the printer a moment to return status data.
-	nanosleep(&(struct timespec){0, 100e6}, NULL);
+	free(s->data);
+	s->data = NULL;
 
-	wait_for_page_end();
+	return s->dots;
 }
 
 /**
  * Wait for a status indicating that the next page can be sent.
  *
- * This function tries to follow the printer status after a page has been
- * submitted.  It will try up to 25 times to read a status struct and find out
- * if an end state has been reached.
+ * This function follows the printer status after a page has been submitted,
+ * until an end state has been reached. How long printing takes is predicted
+ * from the number of lines and the speed measured on earlier pages (from
+ * the printer starting to print until it is ready again). The page is given
+ * up on if the printer takes much longer than predicted. Time the printer
+ * spends cooling down is not counted, up to COOLING_TIMEOUT.
+ *
+ * Cooling notifications are passed on to the thermal model.
+ *
+ * @param job the print job
+ * @param record the page that has been sent
+ * @param status filled with the last status read
+ * @returns true if an end state has been reached
  */
-void
-wait_for_page_end()
+bool
+wait_for_page_end(print_job *job, page_record *record, ql_status *status)
 {
-	ql_status status = {0};
+	uint8_t printer_id = job->model->printer_id;
+	double predicted = ql_speed_predict(&job->speed, printer_id,
+			record->resolution, record->lines);
+	double start = monotonic_time();
+	double deadline = start + 2 * predicted + PAGE_END_SLACK;
+	double printing = 0;
+	double cooling = 0;
+	bool cooled = false;
+	bool late = false;
+	bool missing = false;
+
+	while (true) {
+		// While the printer cools down, the time is not counted
+		// against the page.
+		double limit = cooling > 0 ? cooling + COOLING_TIMEOUT : deadline;
+		double now = monotonic_time();
+
+		if (now >= limit || cancelled)
+			break;
+
+		// Status is sent as soon as something happens, the timeout
+		// only matters when the page takes longer than expected.
+		double expected = (printing > 0 ? printing : start) + predicted;
+		double timeout = (expected > now ? expected - now : 0) + STATUS_SLACK;
+
+		if (timeout > limit - now)
+			timeout = limit - now;
+
+		if (!backchannel_read_status(status, timeout)) {
+			// Count a gap in the status only once, the backchannel
+			// may keep failing right away.
+			if (!missing)
+				job->metrics.short_reads++;
+
+			missing = true;
+
+			if (!late && monotonic_time() > expected) {
+				fprintf(stderr, "DEBUG: Page takes longer than expected (%.1f s).\n",
+						predicted);
+				late = true;
+			}
+
+			// Do not spin on a backchannel that fails at once.
+			double pause = limit - monotonic_time();
+
+			if (pause > STATUS_RETRY)
+				pause = STATUS_RETRY;
+
+			if (pause > 0)
+				nanosleep(&(struct timespec){0, pause * 1e9}, NULL);
 
-	for (uint8_t i = 0; i < 25; i++) {
-		// Sleep and skip in case of error.
-		if (!backchannel_read_status(&status)) {
-			nanosleep(&(struct timespec){0, 100e6}, NULL);
-			fprintf(stderr, "ERROR: Backchannel short read, retrying.\n");
 			continue;
 		}
-		
+
+		missing = false;
+
 		// Skip this round if data seems to be corrupt.
-		if (status.print_head_mark != 0x80) {
+		if (status->print_head_mark != 0x80) {
 			fprintf(stderr, "ERROR: Print status returned is invalid, retrying.\n");
+			job->metrics.short_reads++;
 			continue;
 		}
 
-		if (handle_status(&status))
-			return;
+		if (status->status_type == ST_NOTIFICATION
+		    && (status->notification_type == NT_COOLING_STARTED
+			|| status->notification_type == NT_COOLING_FINISHED)) {
+			ql_thermal_cooling(&job->thermal,
+					status->notification_type == NT_COOLING_STARTED);
+			cooled = true;
+			now = monotonic_time();
+
+			if (status->notification_type == NT_COOLING_STARTED) {
+				job->metrics.cooling++;
+
+				if (cooling == 0)
+					cooling = now;
+			} else if (cooling > 0) {
+				deadline += now - cooling;
+				cooling = 0;
+			}
+		}
+
+		if (status->status_type == ST_ERROR)
+			ql_metrics_error(&job->metrics, status->error_info_1, status->error_info_2);
+
+		if (status->status_type == ST_PHASE_CHANGE) {
+			now = monotonic_time();
+
+			if (status->phase_type == PT_PRINTING) {
+				printing = now;
+			} else if (printing > 0 && !cooled
+				   && ql_speed_update(&job->speed, printer_id,
+					   record->resolution, record->lines, now - printing)) {
+				fprintf(stderr, "DEBUG: Printed %d lines in %.2f s, now expecting %.0f lines/s.\n",
+						record->lines, now - printing,
+						ql_speed_get(&job->speed, printer_id, record->resolution));
+			}
+		}
+
+		if (handle_status(status))
+			return true;
 	}
-}
 
+	if (!cancelled)
+		fprintf(stderr, "ERROR: Printer did not finish the page in time.\n");
+
+	return false;
+}
 
 /**
  * Turns status information into user visible information.
@@ -286,13 +1617,17 @@ handle_status(ql_status *status)
  *
  * @param status status struct to populate with a response from the printer
  * @param device file descriptor to write to
+ * @param retries incremented for each try after the first
  */
 bool
-init(ql_status *status, FILE* device)
+init(ql_status *status, FILE* device, uint64_t *retries)
 {
 	bool flush = false;
 
 	for(int i = 0; i < 10; ++i) {
+		if (i > 0)
+			(*retries)++;
+
 		ql_init(flush, device);
 
 		nanosleep(&(struct timespec){0, 100e6}, NULL);
@@ -313,13 +1648,25 @@ init(ql_status *status, FILE* device)
 /**
  * Read status information from backchannel.
  *
+ * When replaying a status trace, the status comes from the trace instead,
+ * with the timing of the recording.
+ *
  * @param status status struct to fill
+ * @param timeout time to wait for the printer, in seconds
  * @returns false if number of bytes read was not `sizeof(ql_status)`
  */
 bool
-backchannel_read_status(ql_status* status)
+backchannel_read_status(ql_status* status, double timeout)
 {
-	ssize_t ret = cupsBackChannelRead((char*)status, sizeof(ql_status), 10.0);
+	ssize_t ret;
+
+	if (status_trace.count > 0) {
+		ret = ql_trace_read(&status_trace, status, sizeof(ql_status), timeout);
+	} else {
+		double start = monotonic_time();
+		ret = cupsBackChannelRead((char*)status, sizeof(ql_status), timeout);
+		ql_trace_add(&status_trace, monotonic_time() - start, status, ret);
+	}
 
 	if (ret != sizeof(ql_status))
 		return false;
@@ -327,6 +1674,20 @@ backchannel_read_status(ql_status* status)
 	return true;
 }
 
+/**
+ * Current time, for measuring durations.
+ *
+ * @returns seconds since some unspecified point in time
+ */
+double
+monotonic_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 /**
  * Insert blank lines into raster data.
  *
@@ -357,5 +1718,321 @@ request_status(ql_status *status, FILE *device)
 	ql_status_request(device);
 
 	// Read response
-	return backchannel_read_status(status);
+	return backchannel_read_status(status, STATUS_TIMEOUT);
+}
+
+/**
+ * Read the fields to draw onto each label from the job options.
+ *
+ * A field is given as `[TYPE] X Y SIZE[xHEIGHT] DATA`: the type (`text`,
+ * which is the default, `code128`, `ean13` or `qr`), the position of the top
+ * left corner in dots (300 per inch) across and lines along the label, the
+ * size and the data. For text the size is the enlargement of the font, for
+ * barcodes it is the width of a module in dots. Bars are BAR_HEIGHT lines
+ * high (at 300 lines per inch), unless the height is given as well.
+ *
+ * Text is drawn with the built-in font, unless a PSF font is set with
+ * `ql-font`.
+ *
+ * @param job the print job
+ * @param num_options number of job options
+ * @param options job options
+ */
+void
+parse_fields(print_job *job, int num_options, cups_option_t *options)
+{
+	static const char *types[] = { "text", "code128", "ean13", "qr" };
+	bool text = false;
+
+	for (unsigned int i = 1; i <= MAX_FIELDS; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "ql-field%u", i);
+
+		const char *value = cupsGetOption(name, num_options, options);
+		label_field *field = &job->fields[job->field_count];
+		char type[16] = "text";
+		int skip = 0;
+
+		if (value == NULL)
+			continue;
+
+		if (sscanf(value, " %15[a-z0-9] %n", type, &skip) == 1
+		    && !(type[0] >= '0' && type[0] <= '9'))
+			value += skip;
+		else
+			strcpy(type, "text");
+
+		field->type = FIELD_TEXT;
+
+		while (field->type <= FIELD_QR && strcmp(type, types[field->type]) != 0)
+			field->type++;
+
+		field->height = BAR_HEIGHT;
+		skip = 0;
+
+		if (field->type <= FIELD_QR)
+			sscanf(value, "%u %u %u%n", &field->x, &field->y, &field->size, &skip);
+
+		const char *data = value + skip;
+		int height = 0;
+
+		if (skip > 0 && *data == 'x' && sscanf(data, "x%u%n", &field->height, &height) == 1)
+			data += height;
+
+		while (*data == ' ')
+			data++;
+
+		if (field->type > FIELD_QR || skip == 0 || field->size == 0 || *data == '\0') {
+			fprintf(stderr, "WARNING: Ignoring invalid field %s.\n", name);
+			continue;
+		}
+
+		field->text = strdup(data);
+
+		if (field->text == NULL)
+			continue;
+
+		text = text || field->type == FIELD_TEXT;
+		job->field_count++;
+	}
+
+	if (!text)
+		return;
+
+	const char *path = cupsGetOption("ql-font", num_options, options);
+
+	if (path != NULL && ql_font_load(&job->font, path))
+		return;
+
+	if (path != NULL)
+		fprintf(stderr, "WARNING: Could not load font %s, using the built-in font.\n", path);
+
+	if (!ql_font_builtin(&job->font))
+		fprintf(stderr, "ERROR: Out of memory, text fields are left out.\n");
+}
+
+/**
+ * Draw the fields for the current label.
+ *
+ * Along the media, text and barcodes are enlarged twice as much at 600 lines
+ * per inch, so that they keep their shape and position.
+ *
+ * @param job the print job
+ * @param resolution lines per inch along the media
+ */
+void
+render_fields(print_job *job, uint16_t resolution)
+{
+	for (unsigned int i = 0; i < job->field_count; i++) {
+		label_field *field = &job->fields[i];
+		unsigned int size = field->size;
+		unsigned int lines = field->size * resolution / 300;
+		char text[256];
+		size_t length = 0;
+		bool ok = false;
+
+		for (const char *c = field->text; *c != '\0' && length < sizeof(text) - 1; c++) {
+			if (strncmp(c, "{serial}", 8) == 0) {
+				length += snprintf(text + length, sizeof(text) - length, "%s", job->serial);
+				c += 7;
+			} else {
+				text[length++] = *c;
+			}
+		}
+
+		text[length < sizeof(text) ? length : sizeof(text) - 1] = '\0';
+
+		ql_bitmap_free(&field->bitmap);
+		field->top = field->y * resolution / 300;
+
+		switch (field->type) {
+		case FIELD_TEXT:
+			if (field->resolution != resolution && job->font.glyphs != NULL) {
+				ql_font_free(&field->font);
+				field->resolution = 0;
+
+				if (ql_font_scale(&job->font, size, lines, &field->font))
+					field->resolution = resolution;
+			}
+
+			ok = field->resolution == resolution
+				&& ql_text_render(&field->font, text, &field->bitmap);
+			break;
+
+		case FIELD_CODE128:
+			ok = ql_code128_render(text, size, field->height * resolution / 300,
+					&field->bitmap);
+			break;
+
+		case FIELD_EAN13:
+			ok = ql_ean13_render(text, size, field->height * resolution / 300,
+					&field->bitmap);
+			break;
+
+		case FIELD_QR:
+			ok = ql_qr_render(text, size, lines, &field->bitmap);
+			break;
+		}
+
+		if (!ok) {
+			fprintf(stderr, "WARNING: Could not draw \"%s\" in field %u.\n",
+					text, i + 1);
+			ql_bitmap_free(&field->bitmap);
+		}
+	}
+}
+
+/**
+ * Add the fields to a raster line.
+ *
+ * @param job the print job
+ * @param line index of the line on the page
+ * @param dst raster line for the print head
+ * @param placement placement of the page
+ */
+void
+draw_fields(const print_job *job, uint32_t line, uint8_t *dst,
+		const ql_placement *placement)
+{
+	for (unsigned int i = 0; i < job->field_count; i++) {
+		const label_field *field = &job->fields[i];
+
+		if (field->bitmap.data != NULL)
+			ql_bitmap_draw(&field->bitmap, field->x, field->top, placement, line, dst);
+	}
+}
+
+/**
+ * Release the fields and the font.
+ *
+ * @param job the print job
+ */
+void
+free_fields(print_job *job)
+{
+	for (unsigned int i = 0; i < job->field_count; i++) {
+		free(job->fields[i].text);
+		ql_font_free(&job->fields[i].font);
+		ql_bitmap_free(&job->fields[i].bitmap);
+	}
+
+	ql_font_free(&job->font);
+}
+
+/**
+ * Count up a serial number.
+ *
+ * The digits at the end are counted up, keeping leading zeros (e.g. A-0099
+ * becomes A-0100). If all digits are nines, another digit is added, as long
+ * as there is room.
+ *
+ * @param serial the serial number, at most MAX_SERIAL bytes including the
+ *        terminating null byte
+ */
+void
+next_serial(char *serial)
+{
+	size_t length = strlen(serial);
+	size_t i = length;
+
+	while (i > 0 && serial[i - 1] == '9') {
+		serial[i - 1] = '0';
+		i--;
+	}
+
+	if (i > 0 && serial[i - 1] >= '0' && serial[i - 1] <= '8') {
+		serial[i - 1]++;
+		return;
+	}
+
+	// Only nines (or no digits at all): insert a one.
+	if (length + 1 < MAX_SERIAL) {
+		memmove(serial + i + 1, serial + i, length - i + 1);
+		serial[i] = '1';
+	}
+}
+
+/**
+ * Path of a file holding the counters of the printer.
+ *
+ * Files are named after the CUPS queue (`PRINTER`) and kept in the directory
+ * given by the environment variable `variable`. The state file goes to
+ * `QL_STATE_DIR`, or the CUPS cache directory if that is not set. The
+ * Prometheus textfile goes to `QL_TEXTFILE_DIR`, for the node exporter.
+ *
+ * @param path filled with the path, MAX_PATH bytes
+ * @param variable environment variable naming the directory
+ * @param suffix file name extension
+ * @returns false if there is no such directory
+ */
+bool
+metrics_path(char *path, const char *variable, const char *suffix)
+{
+	const char *dir = getenv(variable);
+	const char *printer = getenv("PRINTER");
+
+	if (dir == NULL && strcmp(variable, "QL_STATE_DIR") == 0)
+		dir = getenv("CUPS_CACHEDIR");
+
+	if (dir == NULL || *dir == '\0')
+		return false;
+
+	if (snprintf(path, MAX_PATH, "%s/rastertoql570-%s%s", dir,
+				printer != NULL ? printer : "default", suffix) >= MAX_PATH)
+		return false;
+
+	// Queue names cannot contain slashes, but be careful anyway.
+	for (char *c = path + strlen(dir) + 1; *c != '\0'; c++)
+		if (*c == '/')
+			*c = '_';
+
+	return true;
+}
+
+/**
+ * Load the lifetime counters and the measured print speed of the printer.
+ *
+ * @param metrics filled with the counters
+ * @param speed filled with the measured speed
+ * @returns false if the counters should not be saved, because there is no
+ *          state directory or the state file could not be read
+ */
+bool
+load_metrics(ql_metrics *metrics, ql_speed *speed)
+{
+	char path[MAX_PATH];
+
+	memset(metrics, 0x00, sizeof(ql_metrics));
+	memset(speed, 0x00, sizeof(ql_speed));
+
+	if (!metrics_path(path, "QL_STATE_DIR", ".state"))
+		return false;
+
+	if (!ql_metrics_load(metrics, speed, path)) {
+		fprintf(stderr, "WARNING: Could not read %s, counters are not kept.\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Save the lifetime counters and export them, see metrics_path().
+ *
+ * @param metrics the counters
+ * @param speed the measured speed
+ */
+void
+save_metrics(const ql_metrics *metrics, const ql_speed *speed)
+{
+	char path[MAX_PATH];
+	const char *printer = getenv("PRINTER");
+
+	if (metrics_path(path, "QL_STATE_DIR", ".state")
+	    && !ql_metrics_save(metrics, speed, path))
+		fprintf(stderr, "WARNING: Could not write %s.\n", path);
+
+	if (metrics_path(path, "QL_TEXTFILE_DIR", ".prom")
+	    && !ql_metrics_export(metrics, speed, printer != NULL ? printer : "default", path))
+		fprintf(stderr, "WARNING: Could not write %s.\n", path);
 }
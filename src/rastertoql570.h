@@ -21,12 +21,496 @@
 #ifndef _RASTERTOQL570_H
 #define _RASTERTOQL570_H
 
-bool backchannel_read_status(ql_status*);
-bool init(ql_status*, FILE*);
+/**
+ * Number of output lines processed as one unit by a worker thread.
+ */
+#define STRIPE_LINES 256
+
+/**
+ * Size of the ring buffer between the encoder and the writer thread.
+ */
+#define WRITER_BUFFER_SIZE (256 * 1024)
+
+/**
+ * How long (in seconds) to wait for the printer to recover from an error
+ * before giving up on a page, unless set with the job option
+ * `ql-resume-timeout`. Zero disables resuming.
+ */
+#define RESUME_TIMEOUT 300
+
+/**
+ * Interval (in seconds) for polling the printer while it recovers.
+ */
+#define RESUME_INTERVAL 2
+
+/**
+ * Time (in seconds) to wait for a response to a status request.
+ */
+#define STATUS_TIMEOUT 10.0
+
+/**
+ * Time (in seconds) to wait for a status beyond the predicted end of a page.
+ */
+#define STATUS_SLACK 1.0
+
+/**
+ * Time (in seconds) a page may take beyond twice the predicted time, before
+ * we give up waiting for it.
+ */
+#define PAGE_END_SLACK 10.0
+
+/**
+ * Time (in seconds) the printer may spend cooling down in the middle of a
+ * page. This time does not count against PAGE_END_SLACK.
+ */
+#define COOLING_TIMEOUT 300.0
+
+/**
+ * Pause (in seconds) after a failed status read, so that a backchannel
+ * that fails right away is not polled in a busy loop.
+ */
+#define STATUS_RETRY 0.1
+
+/**
+ * Time constant (in seconds) for the print head cooling down, see
+ * ql_thermal_init().
+ */
+#define THERMAL_TAU 60.0
+
+/**
+ * Number of pages held back for reordering, unless set with the job option
+ * `ql-thermal-window`.
+ */
+#define THERMAL_WINDOW 8
+
+/**
+ * Number of fields that can be drawn onto each label, set with the job
+ * options `ql-field1` to `ql-field8`.
+ */
+#define MAX_FIELDS 8
+
+/**
+ * Height of barcodes in lines (at 300 lines per inch), unless given with the
+ * field.
+ */
+#define BAR_HEIGHT 75
+
+/**
+ * Longest serial number, see print_job.serial.
+ */
+#define MAX_SERIAL 32
+
+/**
+ * How far (in millimetres) a page may be wider than the loaded media, or
+ * differ from the length of die-cut labels, see check_media().
+ */
+#define MEDIA_TOLERANCE 2.0
+
+/**
+ * Longest path of the state file and the exported metrics, see
+ * load_metrics().
+ */
+#define MAX_PATH 4096
+
+enum thermal_mode {
+	/**
+	 * Ignore the thermal model.
+	 */
+	THERMAL_OFF,
+
+	/**
+	 * Pause before a page that would make the printer stop to cool.
+	 */
+	THERMAL_PACE,
+
+	/**
+	 * Additionally print lighter pages first, if the job allows changing
+	 * the order of pages.
+	 */
+	THERMAL_REORDER
+};
+
+enum cut_mode {
+	/**
+	 * Cut after every `cut_interval` labels, and at the end of the job.
+	 */
+	CUT_EVERY,
+
+	/**
+	 * Only cut at the end of the job.
+	 */
+	CUT_END,
+
+	CUT_NONE
+};
+
+enum media_check {
+	MEDIA_CHECK_OFF,
+
+	/**
+	 * Warn about pages that do not fit the loaded media.
+	 */
+	MEDIA_CHECK_WARN,
+
+	/**
+	 * Stop the job before sending the first page that does not fit.
+	 */
+	MEDIA_CHECK_ABORT
+};
+
+enum field_type {
+	FIELD_TEXT,
+	FIELD_CODE128,
+	FIELD_EAN13,
+	FIELD_QR
+};
+
+typedef struct label_field label_field;
+struct label_field {
+	enum field_type type;
+
+	/**
+	 * Top left corner on the page, in dots across and lines along the
+	 * media at 300 lines per inch.
+	 */
+	uint32_t x;
+	uint32_t y;
+
+	/**
+	 * Enlargement of the font, or width of a barcode module in dots.
+	 */
+	unsigned int size;
+
+	/**
+	 * Height of bars in lines at 300 lines per inch.
+	 */
+	uint32_t height;
+
+	/**
+	 * Text or data to draw, `{serial}` is replaced with the serial
+	 * number.
+	 */
+	char *text;
+
+	/**
+	 * The font enlarged for this field, at the resolution `resolution`.
+	 */
+	ql_font font;
+	uint16_t resolution;
+
+	/**
+	 * The field on the current label, and its first line at the
+	 * resolution of the label.
+	 */
+	ql_bitmap bitmap;
+	uint32_t top;
+};
+
+typedef struct label_template label_template;
+struct label_template {
+	/**
+	 * Raster lines of the page as prepared for the print head, before
+	 * fields are drawn, or NULL.
+	 */
+	uint8_t *lines;
+	uint32_t height;
+	uint16_t resolution;
+	ql_placement placement;
+};
+
+typedef struct print_job print_job;
+struct print_job {
+	const ql_model *model;
+
+	/**
+	 * Loaded media, or NULL if unknown.
+	 */
+	const ql_media *media;
+
+	/**
+	 * Loaded media type as reported by the printer, see #ql_media_type.
+	 */
+	uint8_t media_type;
+
+	/**
+	 * See #media_check, set with the job option `ql-media-check`.
+	 */
+	enum media_check media_check;
+
+	/**
+	 * See #cut_mode, set with the job option `ql-cut`.
+	 */
+	enum cut_mode cut_mode;
+	uint8_t cut_interval;
+
+	/**
+	 * Set once there are no more pages to be read, the last page sent
+	 * afterwards ends the job. Only used when reordering.
+	 */
+	bool ended;
+
+	/**
+	 * Page sent in order, waiting for its page end until the next page
+	 * starts or the job ends, or NULL. See finish_previous().
+	 */
+	struct page_record *previous;
+
+	/**
+	 * Worker threads, or NULL to process everything on the main thread.
+	 */
+	ql_pool *pool;
+
+	/**
+	 * Writer thread feeding `device`, or NULL if writing directly.
+	 */
+	ql_writer *writer;
+
+	FILE *device;
+
+	/**
+	 * The printer itself, bypassing the writer thread. Only use this while
+	 * the writer is drained.
+	 */
+	FILE *direct;
+
+	/**
+	 * Number of pages sent so far.
+	 */
+	unsigned int page_counter;
+	int resume_timeout;
+
+	/**
+	 * See #thermal_mode, set with the job option `ql-thermal`.
+	 */
+	enum thermal_mode thermal_mode;
+	ql_thermal thermal;
+
+	/**
+	 * Measured print speed.
+	 */
+	ql_speed speed;
+
+	/**
+	 * Lifetime counters of the printer, saved at the end of the job if
+	 * they could be loaded.
+	 */
+	ql_metrics metrics;
+	bool metrics_loaded;
+
+	/**
+	 * Raster lines of the job by input line, for input lines that
+	 * repeat. NULL if every line is scaled and placed.
+	 */
+	ql_line_cache *line_cache;
+
+	/**
+	 * Number of black dots on the last page sent.
+	 */
+	uint64_t last_dots;
+
+	/**
+	 * Number of pages held back for reordering, zero if pages are sent
+	 * in order, while they are encoded.
+	 */
+	unsigned int window;
+
+	/**
+	 * Fields drawn onto each label. Text is drawn with `font`, set by
+	 * `ql-font`.
+	 */
+	label_field fields[MAX_FIELDS];
+	unsigned int field_count;
+	ql_font font;
+
+	/**
+	 * Serial number of the current label. The digits at the end are
+	 * counted up after each label.
+	 */
+	char serial[MAX_SERIAL];
+
+	/**
+	 * Number of labels printed from each page, set with `ql-labels`. All
+	 * but the first are made from `template`, only the fields are drawn
+	 * again.
+	 */
+	unsigned int labels;
+	label_template template;
+};
+
+typedef struct page_record page_record;
+struct page_record {
+	/**
+	 * Commands of a page, written to an in-memory stream. The stream is
+	 * closed once the page is complete, see end_page().
+	 */
+	FILE *stream;
+	char *data;
+	size_t size;
+
+	/**
+	 * Number of bytes already sent to the printer.
+	 */
+	size_t sent;
+
+	/**
+	 * Sent ahead of the recorded commands, see start_page().
+	 */
+	ql_print_info print_info;
+
+	/**
+	 * Number of lines and lines per inch, for predicting how long
+	 * printing takes.
+	 */
+	uint32_t lines;
+	uint16_t resolution;
+
+	/**
+	 * Number of black dots on the page.
+	 */
+	uint64_t dots;
+
+	/**
+	 * Number of times later pages were sent first.
+	 */
+	unsigned int passed;
+
+	/**
+	 * Whether this is the last page of the job, for the page end sent by
+	 * finish_page().
+	 */
+	bool last;
+};
+
+typedef struct page_state page_state;
+struct page_state {
+	const print_job *job;
+	const cups_page_header2_t *header;
+
+	/**
+	 * Resolution sent to the printer, see handle_page().
+	 */
+	unsigned int resolution[2];
+	uint32_t out_width;
+	uint32_t out_height;
+
+	/**
+	 * Scaler of the main thread, used to find the input lines of a
+	 * stripe. Each stripe uses its own scaler.
+	 */
+	const ql_scaler *scaler;
+	ql_placement placement;
+
+	/**
+	 * Error diffusion state, handed from one stripe to the next.
+	 */
+	ql_dither dither;
+	unsigned int dither_turn;
+
+	/**
+	 * Protects `dither_turn` and the `done` flag of the stripes.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+
+	/**
+	 * Where to keep the raster lines for later labels, or NULL.
+	 */
+	uint8_t *cache;
+
+	/**
+	 * Per-line work for the print head of the printer, chosen once per
+	 * page.
+	 */
+	const ql_kernel *kernel;
+
+	/**
+	 * The line cache of the job, if each raster line of this page is
+	 * made from one input line, the same way every time. NULL otherwise.
+	 */
+	ql_line_cache *line_cache;
+};
+
+/**
+ * What decides how an input line is turned into a raster line for the
+ * print head, see ql_line_cache_prepare().
+ */
+typedef struct line_layout line_layout;
+struct line_layout {
+	uint32_t width;
+	uint32_t out_width;
+	ql_placement placement;
+};
+
+typedef struct stripe stripe;
+struct stripe {
+	page_state *page;
+	unsigned int index;
+
+	/**
+	 * Output lines of this stripe.
+	 */
+	uint32_t first_line;
+	uint32_t lines;
+
+	/**
+	 * Input lines needed for the output lines.
+	 */
+	uint32_t first_row;
+	uint32_t rows;
+	uint8_t *input;
+
+	/**
+	 * Encoded raster commands.
+	 */
+	char *data;
+	size_t size;
+
+	/**
+	 * Number of black dots in the stripe.
+	 */
+	uint64_t dots;
+
+	bool done;
+	bool failed;
+};
+
+bool backchannel_read_status(ql_status*, double);
+bool init(ql_status*, FILE*, uint64_t*);
 bool request_status(ql_status*, FILE*);
-void wait_for_page_end();
+bool wait_for_page_end(print_job*, page_record*, ql_status*);
 bool handle_status(ql_status*);
+double monotonic_time(void);
 void print_blank_lines(uint32_t count, size_t buffer_size, FILE *device);
-void handle_page(cups_raster_t*, cups_page_header2_t, unsigned int, FILE*);
+bool check_media(const print_job*, const cups_page_header2_t*);
+bool handle_page(cups_raster_t*, cups_page_header2_t, print_job*, page_record*);
+int begin_page(print_job*, page_record*, uint32_t, uint16_t);
+void end_page(print_job*, page_record*, int);
+void queue_page(print_job*, page_record*, unsigned int*);
+bool template_page(print_job*, page_record*);
+void send_next_page(print_job*, page_record*, unsigned int*);
+void start_page(print_job*, page_record*, uint64_t);
+void finish_previous(print_job*, bool);
+unsigned int worker_count(int, cups_option_t*);
+void parse_cut(print_job*, const char*);
+void print_writer_stats(const ql_writer_stats*);
+bool read_stripe(cups_raster_t*, stripe*, uint32_t*, uint8_t*);
+void skip_rows(cups_raster_t*, const cups_page_header2_t*, uint32_t);
+void process_stripe(void*);
+uint64_t write_stripe(stripe*, FILE*);
+uint64_t encode_lines(const ql_kernel*, const uint8_t*, uint32_t, size_t, FILE*);
+bool finish_page(print_job*, page_record*);
+bool is_recoverable(const ql_status*);
+bool resume_page(print_job*, page_record*);
+bool record_open(page_record*);
+void record_send(page_record*, FILE*);
+void record_free(page_record*);
+void parse_fields(print_job*, int, cups_option_t*);
+void render_fields(print_job*, uint16_t);
+void draw_fields(const print_job*, uint32_t, uint8_t*, const ql_placement*);
+void free_fields(print_job*);
+void next_serial(char*);
+bool metrics_path(char*, const char*, const char*);
+bool load_metrics(ql_metrics*, ql_speed*);
+void save_metrics(const ql_metrics*, const ql_speed*);
 
 #endif
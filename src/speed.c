@@ -0,0 +1,187 @@
+/* speed.c: measured print speed of the printer
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stddef.h>
+
+#include "speed.h"
+
+/**
+ * Speed assumed before anything has been measured, in lines per second. The
+ * QL-570 is specified with up to 110mm/s, which is about 1300 lines per second
+ * at 300 lines per inch. This errs on the slow side.
+ */
+#define QL_SPEED_DEFAULT 1000.0
+
+/**
+ * Weight of a new measurement in the moving average.
+ */
+#define QL_SPEED_WEIGHT 0.25
+
+/**
+ * Measurements this far off the current average are ignored, something else
+ * (e.g. cooling, a paused printer) must have been going on.
+ */
+#define QL_SPEED_OUTLIER 4.0
+
+/**
+ * Number of measurements before outliers are ignored, and number of outliers
+ * in a row that replace the average.
+ */
+#define QL_SPEED_SETTLE 3
+
+/**
+ * Outliers in a row agree if they are within this factor of each other.
+ */
+#define QL_SPEED_AGREE 1.5
+
+/**
+ * Shortest print time we trust, shorter pages are dominated by the printer's
+ * reaction time rather than its speed.
+ */
+#define QL_SPEED_MIN_SECONDS 0.2
+
+static ql_speed_entry *
+find(const ql_speed *speed, uint8_t printer_id, uint16_t resolution)
+{
+	for (unsigned int i = 0; i < speed->count; i++) {
+		const ql_speed_entry *entry = &speed->entries[i];
+
+		if (entry->printer_id == printer_id && entry->resolution == resolution)
+			return (ql_speed_entry *)entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * Get the print speed of a printer.
+ *
+ * @param speed table of measurements
+ * @param printer_id printer as reported in ql_status.printer_id
+ * @param resolution lines per inch along the media
+ * @return lines per second
+ */
+double
+ql_speed_get(const ql_speed *speed, uint8_t printer_id, uint16_t resolution)
+{
+	const ql_speed_entry *entry = find(speed, printer_id, resolution);
+
+	if (entry == NULL || entry->samples == 0)
+		return QL_SPEED_DEFAULT;
+
+	return entry->lines_per_second;
+}
+
+/**
+ * Add a measurement.
+ *
+ * The first QL_SPEED_SETTLE measurements are averaged as they are. After
+ * that, a measurement far off the average is held back as an outlier. If
+ * QL_SPEED_SETTLE outliers in a row agree with each other, the average was
+ * wrong rather than them (e.g. the first pages were timed while the printer
+ * was cooling down), and it is replaced by theirs.
+ *
+ * @param speed table of measurements
+ * @param printer_id printer as reported in ql_status.printer_id
+ * @param resolution lines per inch along the media
+ * @param lines number of lines printed
+ * @param seconds time from the printer starting to print to being ready
+ * @return false if the measurement was discarded as too short or an outlier
+ */
+bool
+ql_speed_update(ql_speed *speed, uint8_t printer_id, uint16_t resolution,
+		uint32_t lines, double seconds)
+{
+	if (seconds < QL_SPEED_MIN_SECONDS)
+		return false;
+
+	double measured = lines / seconds;
+	ql_speed_entry *entry = find(speed, printer_id, resolution);
+
+	if (entry == NULL) {
+		// Forget the oldest entry when the table is full.
+		if (speed->count == QL_SPEED_ENTRIES) {
+			for (unsigned int i = 1; i < speed->count; i++)
+				speed->entries[i - 1] = speed->entries[i];
+
+			speed->count--;
+		}
+
+		entry = &speed->entries[speed->count++];
+		entry->printer_id = printer_id;
+		entry->resolution = resolution;
+		entry->samples = 0;
+		entry->outliers = 0;
+	}
+
+	if (entry->samples < QL_SPEED_SETTLE) {
+		entry->lines_per_second += (measured - entry->lines_per_second)
+				/ (entry->samples + 1);
+		entry->samples++;
+		return true;
+	}
+
+	double ratio = measured / entry->lines_per_second;
+
+	if (ratio <= QL_SPEED_OUTLIER && ratio >= 1 / QL_SPEED_OUTLIER) {
+		entry->lines_per_second += QL_SPEED_WEIGHT * (measured - entry->lines_per_second);
+		entry->samples++;
+		entry->outliers = 0;
+		return true;
+	}
+
+	ratio = measured / entry->outlier_lines_per_second;
+
+	if (entry->outliers == 0 || ratio > QL_SPEED_AGREE || ratio < 1 / QL_SPEED_AGREE) {
+		entry->outlier_lines_per_second = measured;
+		entry->outliers = 1;
+		return false;
+	}
+
+	entry->outliers++;
+	entry->outlier_lines_per_second += (measured - entry->outlier_lines_per_second)
+			/ entry->outliers;
+
+	if (entry->outliers < QL_SPEED_SETTLE)
+		return false;
+
+	entry->lines_per_second = entry->outlier_lines_per_second;
+	entry->samples = entry->outliers;
+	entry->outliers = 0;
+
+	return true;
+}
+
+/**
+ * Predict how long printing a page takes.
+ *
+ * @param speed table of measurements
+ * @param printer_id printer as reported in ql_status.printer_id
+ * @param resolution lines per inch along the media
+ * @param lines number of lines on the page
+ * @return time in seconds
+ */
+double
+ql_speed_predict(const ql_speed *speed, uint8_t printer_id,
+		uint16_t resolution, uint32_t lines)
+{
+	return lines / ql_speed_get(speed, printer_id, resolution);
+}
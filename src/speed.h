@@ -0,0 +1,71 @@
+/* speed.h: measured print speed of the printer
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SPEED_H_
+#define _SPEED_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Number of printer model and resolution combinations to keep track of.
+ */
+#define QL_SPEED_ENTRIES 8
+
+typedef struct ql_speed_entry ql_speed_entry;
+struct ql_speed_entry {
+	/**
+	 * See #ql_printer_type.
+	 */
+	uint8_t printer_id;
+
+	/**
+	 * Lines per inch along the media, 300 or 600.
+	 */
+	uint16_t resolution;
+
+	/**
+	 * Moving average of the measured speed, in lines per second.
+	 */
+	double lines_per_second;
+	uint32_t samples;
+
+	/**
+	 * Average of the outliers measured in a row since the last accepted
+	 * measurement, and their number. See ql_speed_update().
+	 */
+	double outlier_lines_per_second;
+	uint32_t outliers;
+};
+
+typedef struct ql_speed ql_speed;
+struct ql_speed {
+	ql_speed_entry entries[QL_SPEED_ENTRIES];
+	unsigned int count;
+};
+
+double ql_speed_get(const ql_speed *speed, uint8_t printer_id, uint16_t resolution);
+bool ql_speed_update(ql_speed *speed, uint8_t printer_id, uint16_t resolution,
+		uint32_t lines, double seconds);
+double ql_speed_predict(const ql_speed *speed, uint8_t printer_id,
+		uint16_t resolution, uint32_t lines);
+
+#endif
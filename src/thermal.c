@@ -0,0 +1,152 @@
+/* thermal.c: a simple thermal model of the print head
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <math.h>
+#include <time.h>
+
+#include "thermal.h"
+
+/**
+ * Fraction of the estimated capacity we aim to stay below.
+ */
+#define THERMAL_MARGIN 0.9
+
+/**
+ * Heat left in the print head after the printer finished cooling, relative to
+ * the capacity. The specification does not tell, this is a guess.
+ */
+#define THERMAL_AFTER_COOLING 0.5
+
+/**
+ * Longest pause inserted before a page, in seconds.
+ */
+#define THERMAL_MAX_DELAY 30.0
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Let the heat decay up to the current time.
+ */
+static void
+ql_thermal_update(ql_thermal *thermal)
+{
+	double t = now();
+
+	thermal->heat *= exp(-(t - thermal->updated) / thermal->tau);
+	thermal->updated = t;
+}
+
+/**
+ * Initialise a thermal model.
+ *
+ * The model starts out without a capacity and never asks for a delay. The
+ * capacity is learned from the printer's cooling notifications: the heat at
+ * the time the printer started cooling is where we have to stay below.
+ *
+ * @param thermal model to initialise
+ * @param tau time constant of the decay in seconds
+ */
+void
+ql_thermal_init(ql_thermal *thermal, double tau)
+{
+	thermal->heat = 0;
+	thermal->tau = tau;
+	thermal->capacity = 0;
+	thermal->updated = now();
+	thermal->cooling_events = 0;
+	thermal->cooling = false;
+}
+
+/**
+ * Account for a printed page.
+ *
+ * @param thermal the model
+ * @param dots number of black dots on the page
+ */
+void
+ql_thermal_add(ql_thermal *thermal, uint64_t dots)
+{
+	ql_thermal_update(thermal);
+	thermal->heat += dots;
+}
+
+/**
+ * Account for a cooling notification.
+ *
+ * @param thermal the model
+ * @param started true for NT_COOLING_STARTED, false for NT_COOLING_FINISHED
+ */
+void
+ql_thermal_cooling(ql_thermal *thermal, bool started)
+{
+	ql_thermal_update(thermal);
+
+	if (started && !thermal->cooling) {
+		thermal->cooling_events++;
+
+		// Each stop means we underestimated the heat, or overestimated
+		// the capacity.
+		if (thermal->capacity == 0 || thermal->heat < thermal->capacity)
+			thermal->capacity = thermal->heat;
+	}
+
+	if (!started && thermal->cooling)
+		thermal->heat = thermal->capacity * THERMAL_AFTER_COOLING;
+
+	thermal->cooling = started;
+}
+
+/**
+ * Time to wait before printing a page, to avoid the printer stopping to cool.
+ *
+ * @param thermal the model
+ * @param dots number of black dots on the next page
+ * @return the delay in seconds, zero if the page can be printed right away
+ */
+double
+ql_thermal_delay(ql_thermal *thermal, uint64_t dots)
+{
+	ql_thermal_update(thermal);
+
+	if (thermal->capacity == 0)
+		return 0;
+
+	double limit = thermal->capacity * THERMAL_MARGIN;
+
+	if (thermal->heat + dots <= limit)
+		return 0;
+
+	// A page that is too hot on its own is printed from a cold head.
+	double target = dots < limit ? limit - dots : limit * (1 - THERMAL_MARGIN);
+	double delay = thermal->tau * log(thermal->heat / target);
+
+	if (delay < 0)
+		return 0;
+
+	return delay < THERMAL_MAX_DELAY ? delay : THERMAL_MAX_DELAY;
+}
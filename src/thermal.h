@@ -0,0 +1,57 @@
+/* thermal.h: a simple thermal model of the print head
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _THERMAL_H_
+#define _THERMAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct ql_thermal ql_thermal;
+struct ql_thermal {
+	/**
+	 * Heat in the print head, measured in printed dots. It decays
+	 * exponentially with the time constant `tau` (in seconds).
+	 */
+	double heat;
+	double tau;
+
+	/**
+	 * Estimated heat at which the printer stops to cool down, or zero as
+	 * long as no cooling has been observed.
+	 */
+	double capacity;
+
+	/**
+	 * Time of the last update, CLOCK_MONOTONIC in seconds.
+	 */
+	double updated;
+
+	unsigned int cooling_events;
+	bool cooling;
+};
+
+void ql_thermal_init(ql_thermal *thermal, double tau);
+void ql_thermal_add(ql_thermal *thermal, uint64_t dots);
+void ql_thermal_cooling(ql_thermal *thermal, bool started);
+double ql_thermal_delay(ql_thermal *thermal, uint64_t dots);
+
+#endif
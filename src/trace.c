@@ -0,0 +1,227 @@
+/* trace.c: recording and replaying status read from the printer
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sleep_for(double seconds)
+{
+	if (seconds > 0)
+		nanosleep(&(struct timespec){(time_t)seconds,
+				(seconds - (time_t)seconds) * 1e9}, NULL);
+}
+
+/**
+ * Start recording reads.
+ *
+ * A trace is a text file with one read per line: the time the read took, the
+ * number of bytes read (0 for a timeout, -1 for an error) and the bytes in
+ * hex.
+ *
+ * @param trace trace to initialise, release with ql_trace_close()
+ * @param path file to write
+ * @return false if the file could not be created
+ */
+bool
+ql_trace_record(ql_trace *trace, const char *path)
+{
+	memset(trace, 0x00, sizeof(ql_trace));
+	trace->file = fopen(path, "w");
+
+	return trace->file != NULL;
+}
+
+/**
+ * Record a read, if recording.
+ *
+ * @param trace the trace
+ * @param delay time the read took, in seconds
+ * @param data bytes read
+ * @param length number of bytes read, 0 for a timeout, -1 for an error
+ */
+void
+ql_trace_add(ql_trace *trace, double delay, const void *data, ssize_t length)
+{
+	if (trace->file == NULL)
+		return;
+
+	if (length > QL_TRACE_MAX_READ)
+		length = QL_TRACE_MAX_READ;
+
+	fprintf(trace->file, "%.6f %d ", delay, (int)length);
+
+	for (ssize_t i = 0; i < length; i++)
+		fprintf(trace->file, "%02x", ((const uint8_t *)data)[i]);
+
+	fputc('\n', trace->file);
+
+	// The job may be cancelled at any time.
+	fflush(trace->file);
+}
+
+/**
+ * Load a trace for replaying.
+ *
+ * Timeouts are folded into the following read, the time until something
+ * arrives is what counts. How long a read waits on replay is up to its own
+ * timeout.
+ *
+ * @param trace trace to initialise, release with ql_trace_close()
+ * @param path trace written by ql_trace_record()
+ * @return false if the file could not be read or is malformed
+ */
+bool
+ql_trace_load(ql_trace *trace, const char *path)
+{
+	memset(trace, 0x00, sizeof(ql_trace));
+
+	FILE *file = fopen(path, "r");
+
+	if (file == NULL)
+		return false;
+
+	char line[32 + 2 * QL_TRACE_MAX_READ];
+	size_t allocated = 0;
+	double waited = 0;
+	bool ok = true;
+
+	while (ok && fgets(line, sizeof(line), file) != NULL) {
+		double delay;
+		int length, offset;
+
+		if (sscanf(line, "%lf %d %n", &delay, &length, &offset) != 2
+		    || length > QL_TRACE_MAX_READ || delay < 0) {
+			ok = false;
+			break;
+		}
+
+		if (length == 0) {
+			waited += delay;
+			continue;
+		}
+
+		if (trace->count == allocated) {
+			allocated = allocated ? 2 * allocated : 64;
+			ql_trace_entry *entries = realloc(trace->entries,
+					allocated * sizeof(ql_trace_entry));
+
+			if (entries == NULL) {
+				ok = false;
+				break;
+			}
+
+			trace->entries = entries;
+		}
+
+		ql_trace_entry *entry = &trace->entries[trace->count++];
+		entry->delay = waited + delay;
+		entry->length = length;
+		waited = 0;
+
+		for (int i = 0; i < length; i++) {
+			unsigned int byte;
+
+			if (sscanf(line + offset + 2 * i, "%2x", &byte) != 1)
+				ok = false;
+
+			entry->data[i] = byte;
+		}
+	}
+
+	fclose(file);
+
+	if (!ok)
+		ql_trace_close(trace);
+
+	return ok;
+}
+
+/**
+ * Replay the next read, like cupsBackChannelRead().
+ *
+ * Each read arrives as long after we started waiting for it as it did when
+ * recording. If the timeout is shorter, the read is kept for the next call.
+ *
+ * @param trace trace loaded with ql_trace_load()
+ * @param buffer filled with the bytes read
+ * @param size size of `buffer`
+ * @param timeout time to wait, in seconds
+ * @return number of bytes read, 0 on timeout, -1 on errors and at the end of
+ *         the trace
+ */
+ssize_t
+ql_trace_read(ql_trace *trace, void *buffer, size_t size, double timeout)
+{
+	if (trace->next >= trace->count)
+		return -1;
+
+	const ql_trace_entry *entry = &trace->entries[trace->next];
+	double start = now();
+
+	if (trace->waiting == 0)
+		trace->waiting = start;
+
+	double arrival = trace->waiting + entry->delay;
+
+	if (arrival > start + timeout) {
+		sleep_for(timeout);
+		return 0;
+	}
+
+	sleep_for(arrival - start);
+	trace->next++;
+	trace->waiting = 0;
+
+	if (entry->length < 0)
+		return -1;
+
+	size_t length = (size_t)entry->length < size ? (size_t)entry->length : size;
+	memcpy(buffer, entry->data, length);
+
+	return length;
+}
+
+/**
+ * Stop recording, or release a loaded trace.
+ *
+ * @param trace the trace
+ */
+void
+ql_trace_close(ql_trace *trace)
+{
+	if (trace->file != NULL)
+		fclose(trace->file);
+
+	free(trace->entries);
+	memset(trace, 0x00, sizeof(ql_trace));
+}
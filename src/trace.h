@@ -0,0 +1,76 @@
+/* trace.h: recording and replaying status read from the printer
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Largest read kept in a trace, in bytes. Status replies are 32 bytes.
+ */
+#define QL_TRACE_MAX_READ 64
+
+typedef struct ql_trace_entry ql_trace_entry;
+struct ql_trace_entry {
+	/**
+	 * Time (in seconds) from starting to wait until the read returned.
+	 */
+	double delay;
+
+	/**
+	 * Number of bytes read, or -1 for an error.
+	 */
+	int length;
+	uint8_t data[QL_TRACE_MAX_READ];
+};
+
+typedef struct ql_trace ql_trace;
+struct ql_trace {
+	/**
+	 * Trace being recorded, or NULL.
+	 */
+	FILE *file;
+
+	/**
+	 * Reads being replayed, `next` is returned by the next call to
+	 * ql_trace_read().
+	 */
+	ql_trace_entry *entries;
+	size_t count;
+	size_t next;
+
+	/**
+	 * When we started waiting for the next entry, or zero.
+	 */
+	double waiting;
+};
+
+bool ql_trace_record(ql_trace *trace, const char *path);
+void ql_trace_add(ql_trace *trace, double delay, const void *data, ssize_t length);
+bool ql_trace_load(ql_trace *trace, const char *path);
+ssize_t ql_trace_read(ql_trace *trace, void *buffer, size_t size, double timeout);
+void ql_trace_close(ql_trace *trace);
+
+#endif
@@ -0,0 +1,751 @@
+/* transform.c: raster line transformations for the QL-570 label printer
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+
+#include "transform.h"
+
+/**
+ * Load eight bytes as a big endian word.
+ *
+ * Bytes outside of the source buffer (including negative indices) read as
+ * zero, so that callers do not need to special-case the ends of a line.
+ *
+ * @param src source buffer
+ * @param src_len length of the source buffer
+ * @param index index of the first byte to load
+ * @return the bytes, with src[index] in the most significant byte
+ */
+static inline uint64_t
+load_be64(const uint8_t *src, size_t src_len, ptrdiff_t index)
+{
+	uint64_t word = 0;
+
+	if (index >= 0 && (size_t)index + 8 <= src_len) {
+		memcpy(&word, src + index, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		word = __builtin_bswap64(word);
+#endif
+		return word;
+	}
+
+	for (ptrdiff_t i = index; i < index + 8; i++) {
+		word <<= 8;
+
+		if (i >= 0 && (size_t)i < src_len)
+			word |= src[i];
+	}
+
+	return word;
+}
+
+/**
+ * Store a word as eight big endian bytes.
+ *
+ * @param dst destination, must have room for eight bytes
+ * @param word the bytes, most significant byte first
+ */
+static inline void
+store_be64(uint8_t *dst, uint64_t word)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	memcpy(dst, &word, 8);
+}
+
+/**
+ * Copy a run of bits from one line into another.
+ *
+ * Bits are counted from the most significant bit of the first byte, which is
+ * how both CUPS and the printer lay out monochrome raster lines. Bits of `dst`
+ * outside of the target range are left untouched.
+ *
+ * The source is shifted eight bytes at a time: each output word is funnelled
+ * together from two consecutive big endian source words, so the cost of the
+ * copy does not depend on the bit offsets.
+ *
+ * @param dst destination line
+ * @param dst_bit first bit to write in `dst`
+ * @param src source line
+ * @param src_len length of the source line in bytes
+ * @param src_bit first bit to read from `src`
+ * @param count number of bits to copy
+ */
+void
+ql_blit(uint8_t *dst, size_t dst_bit, const uint8_t *src, size_t src_len,
+		size_t src_bit, size_t count)
+{
+	if (count == 0)
+		return;
+
+	size_t first = dst_bit / 8;
+	size_t last = (dst_bit + count - 1) / 8;
+
+	uint8_t head_mask = 0xFF >> (dst_bit % 8);
+	uint8_t tail_mask = 0xFF << (7 - (dst_bit + count - 1) % 8);
+	uint8_t head = dst[first];
+	uint8_t tail = dst[last];
+
+	// Bit `b` of the destination is bit `b + src_bit - dst_bit` of the
+	// source. Since the destination is walked byte aligned, the source is
+	// read at a constant shift, starting at bit `delta`.
+	ptrdiff_t delta = (ptrdiff_t)(first * 8 + src_bit) - (ptrdiff_t)dst_bit;
+	ptrdiff_t index = delta >= 0 ? delta / 8 : -((7 - delta) / 8);
+	unsigned int shift = delta - index * 8;
+
+	uint64_t hi = load_be64(src, src_len, index);
+
+	for (size_t i = first; i <= last; i += 8, index += 8) {
+		uint64_t lo = load_be64(src, src_len, index + 8);
+		uint64_t word = shift ? (hi << shift) | (lo >> (64 - shift)) : hi;
+
+		if (i + 8 <= last + 1) {
+			store_be64(dst + i, word);
+		} else {
+			for (size_t j = i; j <= last; j++, word <<= 8)
+				dst[j] = word >> 56;
+		}
+
+		hi = lo;
+	}
+
+	dst[first] = (head & ~head_mask) | (dst[first] & head_mask);
+	dst[last] = (tail & ~tail_mask) | (dst[last] & tail_mask);
+}
+
+/**
+ * Combine a run of bits from one line with another.
+ *
+ * Like ql_blit(), but the bits are OR-ed into `dst`: black dots of the source
+ * are added, black dots already in the destination stay black.
+ *
+ * @param dst destination line
+ * @param dst_bit first bit to write in `dst`
+ * @param src source line
+ * @param src_len length of the source line in bytes
+ * @param src_bit first bit to read from `src`
+ * @param count number of bits to combine
+ */
+void
+ql_blit_or(uint8_t *dst, size_t dst_bit, const uint8_t *src, size_t src_len,
+		size_t src_bit, size_t count)
+{
+	if (count == 0)
+		return;
+
+	size_t first = dst_bit / 8;
+	size_t last = (dst_bit + count - 1) / 8;
+
+	uint8_t head_mask = 0xFF >> (dst_bit % 8);
+	uint8_t tail_mask = 0xFF << (7 - (dst_bit + count - 1) % 8);
+
+	ptrdiff_t delta = (ptrdiff_t)(first * 8 + src_bit) - (ptrdiff_t)dst_bit;
+	ptrdiff_t index = delta >= 0 ? delta / 8 : -((7 - delta) / 8);
+	unsigned int shift = delta - index * 8;
+
+	uint64_t hi = load_be64(src, src_len, index);
+
+	for (size_t i = first; i <= last; i += 8, index += 8) {
+		uint64_t lo = load_be64(src, src_len, index + 8);
+		uint64_t word = shift ? (hi << shift) | (lo >> (64 - shift)) : hi;
+
+		// Bits before and after the target range are not ours.
+		if (i == first)
+			word &= ((uint64_t)head_mask << 56) | (UINT64_MAX >> 8);
+
+		if (last < i + 8)
+			word &= ~(((uint64_t)(uint8_t)~tail_mask) << (56 - 8 * (last - i)));
+
+		if (i + 8 <= last + 1) {
+			store_be64(dst + i, load_be64(dst, last + 1, i) | word);
+		} else {
+			for (size_t j = i; j <= last; j++, word <<= 8)
+				dst[j] |= word >> 56;
+		}
+
+		hi = lo;
+	}
+}
+
+/**
+ * Set a run of bits.
+ *
+ * The bytes between the first and the last one are filled as a whole.
+ *
+ * @param dst destination line
+ * @param bit first bit to set
+ * @param count number of bits to set
+ */
+void
+ql_fill(uint8_t *dst, size_t bit, size_t count)
+{
+	if (count == 0)
+		return;
+
+	size_t first = bit / 8;
+	size_t last = (bit + count - 1) / 8;
+	uint8_t head_mask = 0xFF >> (bit % 8);
+	uint8_t tail_mask = 0xFF << (7 - (bit + count - 1) % 8);
+
+	if (first == last) {
+		dst[first] |= head_mask & tail_mask;
+		return;
+	}
+
+	dst[first] |= head_mask;
+	memset(dst + first + 1, 0xFF, last - first - 1);
+	dst[last] |= tail_mask;
+}
+
+/**
+ * Allocate a blank bitmap.
+ *
+ * @param bitmap bitmap to initialise, release with ql_bitmap_free()
+ * @param width width in dots
+ * @param height height in lines
+ * @returns false if out of memory
+ */
+bool
+ql_bitmap_init(ql_bitmap *bitmap, uint32_t width, uint32_t height)
+{
+	bitmap->width = width;
+	bitmap->height = height;
+	bitmap->stride = (width + 7) / 8;
+	bitmap->data = calloc(height * bitmap->stride + 1, 1);
+
+	return bitmap->data != NULL;
+}
+
+/**
+ * Release a bitmap.
+ *
+ * @param bitmap bitmap initialised with ql_bitmap_init()
+ */
+void
+ql_bitmap_free(ql_bitmap *bitmap)
+{
+	free(bitmap->data);
+	bitmap->data = NULL;
+}
+
+/**
+ * Draw a bitmap onto a raster line.
+ *
+ * The bitmap is positioned in page coordinates, i.e. like the input lines
+ * passed to ql_place(). The part of the bitmap that lies on `line` is added
+ * to the raster line, clipped to the printable area.
+ *
+ * @param bitmap the bitmap
+ * @param x first dot of the bitmap on the page
+ * @param y first line of the bitmap on the page
+ * @param placement placement of the page, see ql_placement_init()
+ * @param line index of the page line
+ * @param dst raster line for the print head, as filled by ql_place()
+ */
+void
+ql_bitmap_draw(const ql_bitmap *bitmap, uint32_t x, uint32_t y,
+		const ql_placement *placement, uint32_t line, uint8_t *dst)
+{
+	if (line < y || line - y >= bitmap->height)
+		return;
+
+	size_t from = x > placement->src_bit ? x : placement->src_bit;
+	size_t to = x + bitmap->width;
+
+	if (to > placement->src_bit + placement->count)
+		to = placement->src_bit + placement->count;
+
+	if (from >= to)
+		return;
+
+	ql_blit_or(dst, placement->dst_bit + from - placement->src_bit,
+			bitmap->data + (line - y) * bitmap->stride, bitmap->stride,
+			from - x, to - from);
+}
+
+/**
+ * Work out where the input lines end up on the print head.
+ *
+ * Pages are expected to span the whole width of the media. The printable area
+ * is cut out of the middle of the input line and moved to the position the
+ * media occupies on the print head. Narrower input lines are centred on the
+ * printable area. If the media is unknown, the input line is copied as-is,
+ * truncated to the width of the print head.
+ *
+ * @param placement placement to initialise
+ * @param model printer model
+ * @param media loaded media, or NULL if unknown
+ * @param width width of the input line in dots
+ */
+void
+ql_placement_init(ql_placement *placement, const ql_model *model,
+		const ql_media *media, uint32_t width)
+{
+	size_t head = model->bytes_per_line * 8;
+
+	if (media == NULL) {
+		placement->src_bit = 0;
+		placement->dst_bit = 0;
+		placement->count = width < head ? width : head;
+		return;
+	}
+
+	size_t printable = media->printable;
+
+	placement->src_bit = width > printable ? (width - printable) / 2 : 0;
+	placement->dst_bit = media->offset + model->offset
+			+ (width < printable ? (printable - width) / 2 : 0);
+	placement->count = width - placement->src_bit;
+
+	if (placement->count > printable)
+		placement->count = printable;
+
+	if (placement->dst_bit + placement->count > head)
+		placement->count = placement->dst_bit < head ? head - placement->dst_bit : 0;
+}
+
+/**
+ * Move an input line into position for the print head.
+ *
+ * @param placement see ql_placement_init()
+ * @param line raster line to fill, will be cleared first
+ * @param line_len length of the raster line in bytes
+ * @param src input line
+ * @param src_len length of the input line in bytes
+ */
+void
+ql_place(const ql_placement *placement, uint8_t *line, size_t line_len,
+		const uint8_t *src, size_t src_len)
+{
+	memset(line, 0x00, line_len);
+	ql_blit(line, placement->dst_bit, src, src_len, placement->src_bit,
+			placement->count);
+}
+
+/**
+ * Bits set in the lower and upper nibble of a byte, compressed to two bits
+ * each. This is the 2:1 box filter for monochrome pixels: a dot is black if
+ * any of the two input dots covering it is black.
+ */
+static uint8_t ql_halve_lut[256];
+
+static void
+ql_halve_lut_init(void)
+{
+	if (ql_halve_lut[0xFF])
+		return;
+
+	for (unsigned int i = 0; i < 256; i++) {
+		uint8_t v = 0;
+
+		for (unsigned int j = 0; j < 4; j++) {
+			if (i & (0xC0 >> (2 * j)))
+				v |= 0x08 >> j;
+		}
+
+		ql_halve_lut[i] = v;
+	}
+}
+
+/**
+ * Build the tables for enlarging monochrome lines.
+ *
+ * When enlarging, each output dot is one input dot and an output byte takes
+ * at most eight consecutive input dots, starting at the column of its first
+ * dot. Which of these go to which output dot depends only on the distances
+ * between the columns, which repeat along the line, so output bytes with the
+ * same distances share a table from input byte to output byte.
+ *
+ * @param scaler scaler with the column table
+ * @return false if out of memory, or with `scaler->pattern` NULL if there
+ *         are too many different tables
+ */
+static bool
+spread_init(ql_scaler *scaler)
+{
+	uint32_t keys[QL_SCALER_PATTERNS];
+	unsigned int count = 0;
+
+	scaler->pattern = malloc(scaler->out_bytes);
+	scaler->spread = malloc(QL_SCALER_PATTERNS * sizeof(scaler->spread[0]));
+
+	if (scaler->pattern == NULL || scaler->spread == NULL)
+		return false;
+
+	for (size_t i = 0; i < scaler->out_bytes; i++) {
+		uint32_t x = i * 8;
+		uint32_t first = scaler->columns[x];
+		uint32_t key = 0;
+
+		// Four bits for the distance of each dot to the first one,
+		// 0xF for dots past the end of the line.
+		for (uint32_t j = 0; j < 8; j++) {
+			uint32_t distance = x + j < scaler->out_width
+					? scaler->columns[x + j] - first : 0xF;
+
+			key = key << 4 | distance;
+		}
+
+		unsigned int p = 0;
+
+		while (p < count && keys[p] != key)
+			p++;
+
+		if (p == count) {
+			if (count == QL_SCALER_PATTERNS) {
+				free(scaler->pattern);
+				scaler->pattern = NULL;
+				return true;
+			}
+
+			keys[count++] = key;
+
+			for (unsigned int v = 0; v < 256; v++) {
+				uint8_t out = 0;
+
+				for (uint32_t j = 0; j < 8; j++) {
+					uint32_t distance = key >> (28 - 4 * j) & 0xF;
+
+					if (distance < 8 && (v << distance) & 0x80)
+						out |= 0x80 >> j;
+				}
+
+				scaler->spread[p][v] = out;
+			}
+		}
+
+		scaler->pattern[i] = p;
+	}
+
+	return true;
+}
+
+/**
+ * Prepare scaling a page to the resolution of the print head.
+ *
+ * The scaler works on whole input lines: for each output line the caller asks
+ * for the span of input lines with ql_scaler_span(), feeds them through
+ * ql_scaler_add() and collects the result with ql_scaler_emit(). When
+ * enlarging, the span of consecutive output lines is the same input line, in
+ * which case nothing needs to be added before the next emit.
+ *
+ * Monochrome input is scaled with a box filter (reducing) or nearest
+ * neighbour (enlarging), which keeps thin lines intact. Eight bit input is
+ * averaged over the covered area, the result is a line of ink values (255 is
+ * black) to be passed through ql_dither_line().
+ *
+ * @param scaler scaler to initialise, release with ql_scaler_free()
+ * @param width width of the input in dots
+ * @param height height of the input in lines
+ * @param bits bits per pixel, 1 or 8
+ * @param white_is_max for 8 bit input, whether 255 is white
+ * @param in_res horizontal and vertical resolution of the input
+ * @param out_res horizontal and vertical resolution of the output
+ * @return false if the input format is not supported or out of memory
+ */
+bool
+ql_scaler_init(ql_scaler *scaler, uint32_t width, uint32_t height,
+		unsigned int bits, bool white_is_max,
+		const unsigned int in_res[2], const unsigned int out_res[2])
+{
+	memset(scaler, 0x00, sizeof(ql_scaler));
+
+	if ((bits != 1 && bits != 8) || in_res[0] == 0 || in_res[1] == 0)
+		return false;
+
+	scaler->in_width = width;
+	scaler->in_height = height;
+	scaler->bits = bits;
+	scaler->white_is_max = white_is_max;
+	scaler->out_width = ((uint64_t)width * out_res[0] + in_res[0] / 2) / in_res[0];
+	scaler->out_height = ((uint64_t)height * out_res[1] + in_res[1] / 2) / in_res[1];
+	scaler->out_bytes = (scaler->out_width + 7) / 8;
+	scaler->line_bytes = bits == 1 ? scaler->out_bytes : scaler->out_width;
+
+	if (scaler->out_width == 0 || scaler->out_height == 0)
+		return false;
+
+	scaler->columns = malloc((scaler->out_width + 1) * sizeof(uint32_t));
+	scaler->line = calloc(scaler->line_bytes, 1);
+
+	if (scaler->columns == NULL || scaler->line == NULL) {
+		ql_scaler_free(scaler);
+		return false;
+	}
+
+	for (uint32_t x = 0; x <= scaler->out_width; x++)
+		scaler->columns[x] = (uint64_t)x * width / scaler->out_width;
+
+	if (bits == 1 && scaler->out_width > width && !spread_init(scaler)) {
+		ql_scaler_free(scaler);
+		return false;
+	}
+
+	if (bits == 8) {
+		scaler->sum = calloc(scaler->out_width, sizeof(uint32_t));
+
+		if (scaler->sum == NULL) {
+			ql_scaler_free(scaler);
+			return false;
+		}
+	}
+
+	ql_halve_lut_init();
+
+	return true;
+}
+
+/**
+ * Release the buffers of a scaler.
+ *
+ * @param scaler scaler initialised with ql_scaler_init()
+ */
+void
+ql_scaler_free(ql_scaler *scaler)
+{
+	free(scaler->columns);
+	free(scaler->pattern);
+	free(scaler->spread);
+	free(scaler->line);
+	free(scaler->sum);
+	memset(scaler, 0x00, sizeof(ql_scaler));
+}
+
+/**
+ * Input lines covering an output line.
+ *
+ * @param scaler the scaler
+ * @param row output line
+ * @param first set to the first input line
+ * @param last set to the input line after the last one
+ */
+void
+ql_scaler_span(const ql_scaler *scaler, uint32_t row, uint32_t *first,
+		uint32_t *last)
+{
+	*first = (uint64_t)row * scaler->in_height / scaler->out_height;
+	*last = (uint64_t)(row + 1) * scaler->in_height / scaler->out_height;
+
+	if (*last <= *first)
+		*last = *first + 1;
+}
+
+/**
+ * Scale a monochrome line horizontally.
+ *
+ * Same resolution, halving (600 dpi input) and enlarging (e.g. 203 dpi input)
+ * are handled a byte at a time, through lookup tables. Other reductions go
+ * through the column table one dot at a time.
+ */
+static void
+scale_line_1bit(const ql_scaler *scaler, const uint8_t *src, uint8_t *dst)
+{
+	size_t in_bytes = (scaler->in_width + 7) / 8;
+
+	if (scaler->out_width == scaler->in_width) {
+		memcpy(dst, src, scaler->out_bytes);
+		return;
+	}
+
+	if (scaler->out_width == (scaler->in_width + 1) / 2) {
+		size_t i;
+
+		for (i = 0; i + 1 < in_bytes; i += 2)
+			dst[i / 2] = ql_halve_lut[src[i]] << 4 | ql_halve_lut[src[i + 1]];
+
+		if (i < in_bytes)
+			dst[i / 2] = ql_halve_lut[src[i]] << 4;
+
+		return;
+	}
+
+	const uint32_t *columns = scaler->columns;
+
+	if (scaler->pattern != NULL) {
+		for (size_t i = 0; i < scaler->out_bytes; i++) {
+			uint32_t c = columns[i * 8];
+			size_t byte = c / 8;
+			uint8_t next = byte + 1 < in_bytes ? src[byte + 1] : 0;
+			uint8_t v = src[byte] << (c % 8) | next >> (8 - c % 8);
+
+			dst[i] = scaler->spread[scaler->pattern[i]][v];
+		}
+
+		return;
+	}
+
+	for (size_t i = 0; i < scaler->out_bytes; i++) {
+		uint8_t v = 0;
+
+		for (uint32_t x = i * 8; x < i * 8 + 8 && x < scaler->out_width; x++) {
+			uint8_t dot = 0;
+
+			for (uint32_t c = columns[x]; c < columns[x + 1] || c == columns[x]; c++)
+				dot |= src[c / 8] << (c % 8);
+
+			v |= (dot & 0x80) >> (x % 8);
+		}
+
+		dst[i] = v;
+	}
+}
+
+/**
+ * Add an input line to the current output line.
+ *
+ * @param scaler the scaler
+ * @param src input line, in the format given to ql_scaler_init()
+ */
+void
+ql_scaler_add(ql_scaler *scaler, const uint8_t *src)
+{
+	if (scaler->bits == 1) {
+		if (scaler->rows == 0) {
+			scale_line_1bit(scaler, src, scaler->line);
+		} else {
+			uint8_t scaled[scaler->out_bytes];
+			scale_line_1bit(scaler, src, scaled);
+
+			for (size_t i = 0; i < scaler->out_bytes; i++)
+				scaler->line[i] |= scaled[i];
+		}
+
+		scaler->rows++;
+		return;
+	}
+
+	const uint32_t *columns = scaler->columns;
+	uint8_t invert = scaler->white_is_max ? 0xFF : 0x00;
+
+	if (scaler->rows == 0)
+		memset(scaler->sum, 0x00, scaler->out_width * sizeof(uint32_t));
+
+	for (uint32_t x = 0; x < scaler->out_width; x++) {
+		uint32_t first = columns[x];
+		uint32_t last = columns[x + 1] > first ? columns[x + 1] : first + 1;
+		uint32_t ink = 0;
+
+		for (uint32_t c = first; c < last; c++)
+			ink += src[c] ^ invert;
+
+		scaler->sum[x] += ink / (last - first);
+	}
+
+	scaler->rows++;
+}
+
+/**
+ * Produce the next output line.
+ *
+ * If no input lines were added since the last call, the previous output line
+ * is repeated (when enlarging).
+ *
+ * @param scaler the scaler
+ * @param dst output line, scaler->line_bytes long
+ */
+void
+ql_scaler_emit(ql_scaler *scaler, uint8_t *dst)
+{
+	if (scaler->bits == 8 && scaler->rows > 0) {
+		for (uint32_t x = 0; x < scaler->out_width; x++)
+			scaler->line[x] = scaler->sum[x] / scaler->rows;
+	}
+
+	memcpy(dst, scaler->line, scaler->line_bytes);
+	scaler->rows = 0;
+}
+
+/**
+ * Prepare error diffusion for lines of the given width.
+ *
+ * @param dither ditherer to initialise, release with ql_dither_free()
+ * @param width line width in dots
+ * @return false if out of memory
+ */
+bool
+ql_dither_init(ql_dither *dither, uint32_t width)
+{
+	dither->width = width;
+	dither->error = calloc(width + 2, sizeof(int16_t));
+	dither->error_next = calloc(width + 2, sizeof(int16_t));
+
+	if (dither->error == NULL || dither->error_next == NULL) {
+		ql_dither_free(dither);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Release the buffers of a ditherer.
+ *
+ * @param dither ditherer initialised with ql_dither_init()
+ */
+void
+ql_dither_free(ql_dither *dither)
+{
+	free(dither->error);
+	free(dither->error_next);
+	memset(dither, 0x00, sizeof(ql_dither));
+}
+
+/**
+ * Diffuse the quantisation error of one line.
+ *
+ * Ink values at or above 128 become a black dot, the difference to the printed
+ * value is spread to the neighbouring dots, with the classic 7/16 to the right
+ * and 3/16, 5/16 and 1/16 to the line below. The error for the line below is
+ * kept in `dither`, so lines must be passed in order.
+ *
+ * @param dither the ditherer
+ * @param src line of ink values, one byte per dot
+ * @param dst output line, 1 bit per dot
+ */
+void
+ql_dither_line(ql_dither *dither, const uint8_t *src, uint8_t *dst)
+{
+	// Dot `x` is at index `x + 1` of the error buffers.
+	int16_t *error = dither->error;
+	int16_t *next = dither->error_next;
+	int carry = 0;
+
+	memset(next, 0x00, (dither->width + 2) * sizeof(int16_t));
+	memset(dst, 0x00, (dither->width + 7) / 8);
+
+	for (uint32_t x = 0; x < dither->width; x++) {
+		int value = src[x] + error[x + 1] + carry;
+		int quantised = value >= 128 ? 255 : 0;
+		int diff = value - quantised;
+
+		if (quantised)
+			dst[x / 8] |= 0x80 >> (x % 8);
+
+		carry = diff * 7 / 16;
+		next[x] += diff * 3 / 16;
+		next[x + 1] += diff * 5 / 16;
+		next[x + 2] += diff / 16;
+	}
+
+	dither->error = next;
+	dither->error_next = error;
+}
@@ -0,0 +1,163 @@
+/* transform.h: raster line transformations for the QL-570 label printer
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _TRANSFORM_H_
+#define _TRANSFORM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ql570.h"
+
+/**
+ * Most tables built for enlarging monochrome lines, see ql_scaler.spread.
+ * A ratio of resolutions needs only a few.
+ */
+#define QL_SCALER_PATTERNS 64
+
+typedef struct ql_placement ql_placement;
+struct ql_placement {
+	/**
+	 * First dot of the input line that ends up on the media.
+	 */
+	size_t src_bit;
+
+	/**
+	 * Position of that dot in the raster line sent to the printer.
+	 */
+	size_t dst_bit;
+
+	/**
+	 * Number of dots to transfer.
+	 */
+	size_t count;
+};
+
+typedef struct ql_bitmap ql_bitmap;
+struct ql_bitmap {
+	uint32_t width;
+	uint32_t height;
+
+	/**
+	 * Size of a line in bytes.
+	 */
+	size_t stride;
+
+	/**
+	 * Lines of 1 bit per dot, most significant bit first.
+	 */
+	uint8_t *data;
+};
+
+typedef struct ql_scaler ql_scaler;
+struct ql_scaler {
+	uint32_t in_width;
+	uint32_t in_height;
+
+	/**
+	 * Bits per pixel of the input, either 1 or 8.
+	 */
+	unsigned int bits;
+
+	/**
+	 * For 8 bit input: zero means black (e.g. CUPS_CSPACE_W).
+	 */
+	bool white_is_max;
+
+	uint32_t out_width;
+	uint32_t out_height;
+
+	/**
+	 * Size of an output line in bytes (1 bit per pixel).
+	 */
+	size_t out_bytes;
+
+	/**
+	 * Size of a line returned by ql_scaler_emit(): out_bytes for 1 bit
+	 * input, out_width (one byte per dot) for 8 bit input.
+	 */
+	size_t line_bytes;
+
+	/**
+	 * First and last+1 input column for each output column.
+	 */
+	uint32_t *columns;
+
+	/**
+	 * Enlarging monochrome input: for each output byte, the table in
+	 * `spread` that turns the eight input dots from its first column
+	 * into it. NULL if there are more than QL_SCALER_PATTERNS tables.
+	 */
+	uint8_t *pattern;
+	uint8_t (*spread)[256];
+
+	/**
+	 * The output line currently being assembled (1 bit input) or the sum
+	 * of ink values of all input lines added so far (8 bit input).
+	 */
+	uint8_t *line;
+	uint32_t *sum;
+	uint32_t rows;
+};
+
+typedef struct ql_dither ql_dither;
+struct ql_dither {
+	uint32_t width;
+
+	/**
+	 * Error carried into the current and the next line. Both buffers have
+	 * a guard cell at either end.
+	 */
+	int16_t *error;
+	int16_t *error_next;
+};
+
+bool ql_scaler_init(ql_scaler *scaler, uint32_t width, uint32_t height,
+		unsigned int bits, bool white_is_max,
+		const unsigned int in_res[2], const unsigned int out_res[2]);
+void ql_scaler_free(ql_scaler *scaler);
+void ql_scaler_span(const ql_scaler *scaler, uint32_t row, uint32_t *first,
+		uint32_t *last);
+void ql_scaler_add(ql_scaler *scaler, const uint8_t *src);
+void ql_scaler_emit(ql_scaler *scaler, uint8_t *dst);
+
+bool ql_dither_init(ql_dither *dither, uint32_t width);
+void ql_dither_free(ql_dither *dither);
+void ql_dither_line(ql_dither *dither, const uint8_t *src, uint8_t *dst);
+
+void ql_placement_init(ql_placement *placement, const ql_model *model,
+		const ql_media *media, uint32_t width);
+void ql_place(const ql_placement *placement, uint8_t *line, size_t line_len,
+		const uint8_t *src, size_t src_len);
+void ql_blit(uint8_t *dst, size_t dst_bit, const uint8_t *src, size_t src_len,
+		size_t src_bit, size_t count);
+void ql_blit_or(uint8_t *dst, size_t dst_bit, const uint8_t *src,
+		size_t src_len, size_t src_bit, size_t count);
+
+void ql_fill(uint8_t *dst, size_t bit, size_t count);
+
+bool ql_bitmap_init(ql_bitmap *bitmap, uint32_t width, uint32_t height);
+void ql_bitmap_free(ql_bitmap *bitmap);
+void ql_bitmap_draw(const ql_bitmap *bitmap, uint32_t x, uint32_t y,
+		const ql_placement *placement, uint32_t line, uint8_t *dst);
+
+#endif
@@ -0,0 +1,400 @@
+/* writer.c: background writer for the printer device
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "writer.h"
+
+/**
+ * Writes taking longer than this count as the device throttling us.
+ */
+#define STALL_THRESHOLD_NS 1000000
+
+/**
+ * Upper bound for sleeping on an empty or full ring buffer. Wakeups are only
+ * sent when the other side announced that it is sleeping, this bounds the
+ * damage should one get lost.
+ */
+#define PARK_TIMEOUT_NS 10000000
+
+struct ql_writer {
+	/**
+	 * The ring buffer. `head` is only advanced by the producer (the
+	 * thread writing to the stream), `tail` only by the writer thread.
+	 * Both count bytes since the start and are reduced modulo `capacity`
+	 * (a power of two) when indexing.
+	 */
+	uint8_t *buffer;
+	size_t capacity;
+	_Atomic size_t head;
+	_Atomic size_t tail;
+
+	int fd;
+	FILE *stream;
+	pthread_t thread;
+
+	_Atomic bool closing;
+	_Atomic bool failed;
+
+	/**
+	 * Parking for either side, only used when the ring buffer is empty
+	 * (writer thread) or full (producer).
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	_Atomic bool writer_parked;
+	_Atomic bool producer_parked;
+
+	_Atomic uint64_t bytes;
+	_Atomic uint64_t writes;
+	_Atomic uint64_t stalls;
+	_Atomic uint64_t stall_ns;
+	uint64_t backpressure_ns;
+	uint64_t max_depth;
+	uint64_t depth_sum;
+	uint64_t depth_samples;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Sleep until woken up by the other side, or PARK_TIMEOUT_NS passed.
+ */
+static void
+park(ql_writer *writer, _Atomic bool *parked, bool (*ready)(ql_writer*))
+{
+	pthread_mutex_lock(&writer->lock);
+	atomic_store(parked, true);
+
+	// Check again after announcing ourselves, the other side may have
+	// made progress in the meantime.
+	if (!ready(writer)) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += PARK_TIMEOUT_NS;
+
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&writer->wakeup, &writer->lock, &ts);
+	}
+
+	atomic_store(parked, false);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+static void
+unpark(ql_writer *writer, _Atomic bool *parked)
+{
+	if (!atomic_load(parked))
+		return;
+
+	pthread_mutex_lock(&writer->lock);
+	pthread_cond_broadcast(&writer->wakeup);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+static bool
+has_data(ql_writer *writer)
+{
+	return atomic_load(&writer->head) != atomic_load(&writer->tail)
+		|| atomic_load(&writer->closing);
+}
+
+static bool
+has_room(ql_writer *writer)
+{
+	return atomic_load(&writer->head) - atomic_load(&writer->tail) < writer->capacity
+		|| atomic_load(&writer->failed);
+}
+
+static bool
+is_drained(ql_writer *writer)
+{
+	return atomic_load(&writer->head) == atomic_load(&writer->tail)
+		|| atomic_load(&writer->failed);
+}
+
+/**
+ * Main loop of the writer thread: drain the ring buffer into the device.
+ */
+static void *
+writer_main(void *arg)
+{
+	ql_writer *writer = arg;
+
+	for (;;) {
+		size_t tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+		size_t head = atomic_load_explicit(&writer->head, memory_order_acquire);
+
+		if (head == tail) {
+			if (atomic_load(&writer->closing))
+				break;
+
+			park(writer, &writer->writer_parked, has_data);
+			continue;
+		}
+
+		// Write up to the end of the buffer, the rest follows in the
+		// next round.
+		size_t offset = tail & (writer->capacity - 1);
+		size_t length = head - tail;
+
+		if (length > writer->capacity - offset)
+			length = writer->capacity - offset;
+
+		uint64_t start = now_ns();
+		ssize_t ret = write(writer->fd, writer->buffer + offset, length);
+		uint64_t elapsed = now_ns() - start;
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			// Nobody is going to read the rest, drop it so that
+			// the producer does not block forever.
+			atomic_store(&writer->failed, true);
+			atomic_store_explicit(&writer->tail, head, memory_order_release);
+			unpark(writer, &writer->producer_parked);
+			continue;
+		}
+
+		atomic_fetch_add(&writer->writes, 1);
+		atomic_fetch_add(&writer->bytes, ret);
+
+		if (elapsed > STALL_THRESHOLD_NS) {
+			atomic_fetch_add(&writer->stalls, 1);
+			atomic_fetch_add(&writer->stall_ns, elapsed);
+		}
+
+		atomic_store_explicit(&writer->tail, tail + ret, memory_order_release);
+		unpark(writer, &writer->producer_parked);
+	}
+
+	return NULL;
+}
+
+/**
+ * Add data to the ring buffer, waiting for room if necessary.
+ *
+ * This is the write function of the stream returned by ql_writer_stream().
+ */
+static ssize_t
+writer_push(void *cookie, const char *data, size_t size)
+{
+	ql_writer *writer = cookie;
+	size_t done = 0;
+
+	while (done < size) {
+		if (atomic_load(&writer->failed))
+			return done > 0 ? (ssize_t)done : -1;
+
+		size_t head = atomic_load_explicit(&writer->head, memory_order_relaxed);
+		size_t tail = atomic_load_explicit(&writer->tail, memory_order_acquire);
+		size_t room = writer->capacity - (head - tail);
+
+		if (room == 0) {
+			uint64_t start = now_ns();
+			park(writer, &writer->producer_parked, has_room);
+			writer->backpressure_ns += now_ns() - start;
+			continue;
+		}
+
+		size_t offset = head & (writer->capacity - 1);
+		size_t length = size - done;
+
+		if (length > room)
+			length = room;
+
+		if (length > writer->capacity - offset)
+			length = writer->capacity - offset;
+
+		memcpy(writer->buffer + offset, data + done, length);
+		atomic_store_explicit(&writer->head, head + length, memory_order_release);
+		unpark(writer, &writer->writer_parked);
+
+		uint64_t depth = head + length - tail;
+
+		if (depth > writer->max_depth)
+			writer->max_depth = depth;
+
+		writer->depth_sum += depth;
+		writer->depth_samples++;
+		done += length;
+	}
+
+	return done;
+}
+
+/**
+ * Start a writer thread for a device.
+ *
+ * Everything written to the stream returned by ql_writer_stream() is queued
+ * in a ring buffer and written to `fd` by a separate thread. The device may
+ * block whenever its own buffer is full, this way only the writer thread is
+ * held up and raster data can still be prepared in the meantime.
+ *
+ * @param fd file descriptor of the device
+ * @param capacity size of the ring buffer, rounded up to a power of two
+ * @return the writer, or NULL on error
+ */
+ql_writer *
+ql_writer_open(int fd, size_t capacity)
+{
+	ql_writer *writer = calloc(1, sizeof(ql_writer));
+
+	if (writer == NULL)
+		return NULL;
+
+	writer->capacity = 1;
+
+	while (writer->capacity < capacity)
+		writer->capacity <<= 1;
+
+	writer->fd = fd;
+	writer->buffer = malloc(writer->capacity);
+
+	cookie_io_functions_t functions = { .write = writer_push };
+	writer->stream = fopencookie(writer, "w", functions);
+
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->wakeup, NULL);
+
+	if (writer->buffer == NULL || writer->stream == NULL
+	    || pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+		if (writer->stream != NULL)
+			fclose(writer->stream);
+
+		pthread_mutex_destroy(&writer->lock);
+		pthread_cond_destroy(&writer->wakeup);
+		free(writer->buffer);
+		free(writer);
+
+		return NULL;
+	}
+
+	// The ring buffer is all the buffering we need.
+	setvbuf(writer->stream, NULL, _IONBF, 0);
+
+	return writer;
+}
+
+/**
+ * The stream to write printer commands to.
+ *
+ * The stream must only be written to from one thread at a time.
+ *
+ * @param writer the writer
+ * @return the stream, closed by ql_writer_close()
+ */
+FILE *
+ql_writer_stream(ql_writer *writer)
+{
+	return writer->stream;
+}
+
+/**
+ * Wait until everything written so far has reached the device.
+ *
+ * This needs to be called before waiting for a response from the printer.
+ *
+ * @param writer the writer
+ * @return false if writing to the device failed
+ */
+bool
+ql_writer_drain(ql_writer *writer)
+{
+	fflush(writer->stream);
+
+	while (!is_drained(writer))
+		park(writer, &writer->producer_parked, is_drained);
+
+	return !atomic_load(&writer->failed);
+}
+
+/**
+ * Get the writer's counters.
+ *
+ * Only call this from the thread writing to the stream.
+ *
+ * @param writer the writer
+ * @param stats struct to fill
+ */
+void
+ql_writer_stats_get(ql_writer *writer, ql_writer_stats *stats)
+{
+	stats->bytes = atomic_load(&writer->bytes);
+	stats->writes = atomic_load(&writer->writes);
+	stats->stalls = atomic_load(&writer->stalls);
+	stats->stall_ns = atomic_load(&writer->stall_ns);
+	stats->backpressure_ns = writer->backpressure_ns;
+	stats->max_depth = writer->max_depth;
+	stats->depth_sum = writer->depth_sum;
+	stats->depth_samples = writer->depth_samples;
+}
+
+/**
+ * Drain the ring buffer and stop the writer thread.
+ *
+ * @param writer the writer, may be NULL
+ * @return false if writing to the device failed
+ */
+bool
+ql_writer_close(ql_writer *writer)
+{
+	if (writer == NULL)
+		return true;
+
+	fclose(writer->stream);
+
+	atomic_store(&writer->closing, true);
+	unpark(writer, &writer->writer_parked);
+	pthread_mutex_lock(&writer->lock);
+	pthread_cond_broadcast(&writer->wakeup);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+
+	bool ok = !atomic_load(&writer->failed);
+
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->wakeup);
+	free(writer->buffer);
+	free(writer);
+
+	return ok;
+}
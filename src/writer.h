@@ -0,0 +1,70 @@
+/* writer.h: background writer for the printer device
+ *
+ * Copyright (C) 2015 Clemens Fries <github-raster@xenoworld.de>
+ *
+ * This file is part of rastertoql570.
+ *
+ * rastertoql570 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rastertoql570 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rastertoql570.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _WRITER_H_
+#define _WRITER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct ql_writer ql_writer;
+
+typedef struct ql_writer_stats ql_writer_stats;
+struct ql_writer_stats {
+	/**
+	 * Bytes written to the device.
+	 */
+	uint64_t bytes;
+
+	/**
+	 * Number of write() calls.
+	 */
+	uint64_t writes;
+
+	/**
+	 * Number of write() calls that blocked for more than a millisecond,
+	 * i.e. the device was throttling us, and the total time spent in
+	 * those calls.
+	 */
+	uint64_t stalls;
+	uint64_t stall_ns;
+
+	/**
+	 * Time the encoder spent waiting for room in the ring buffer.
+	 */
+	uint64_t backpressure_ns;
+
+	/**
+	 * Queue depth in bytes, sampled whenever data is added.
+	 */
+	uint64_t max_depth;
+	uint64_t depth_sum;
+	uint64_t depth_samples;
+};
+
+ql_writer *ql_writer_open(int fd, size_t capacity);
+FILE *ql_writer_stream(ql_writer *writer);
+bool ql_writer_drain(ql_writer *writer);
+void ql_writer_stats_get(ql_writer *writer, ql_writer_stats *stats);
+bool ql_writer_close(ql_writer *writer);
+
+#endif